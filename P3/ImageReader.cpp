@@ -1,8 +1,9 @@
 #include "ImageReader.h"
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <filesystem>
 #include <opencv2/highgui.hpp>
-#include <io.h>
 
 
 
@@ -39,29 +40,39 @@ DataObject ImageReader::loadFile(const std::string& filename)
 	obj.image = loadImage(filename);
 	obj.eye = loadEyePos(filename);
 	obj.filename = filename;
+	obj.identity = parseIdentity(filename);
 
 	return obj;
 }
 
-std::vector<DataObject> ImageReader::loadDataSet(const std::string& dir, int max)
+// paths of the pgm files in dir without the suffix, in name order
+std::vector<std::string> findPgmFiles(const std::string& dir, int max)
 {
-	std::vector<DataObject> dataSet;
+	std::vector<std::string> names;
+	std::error_code error;
+	std::filesystem::directory_iterator it(dir, error);
+	if (error)
+		return names;
 
-	// windows io function
-	_finddata_t findData;
-	auto hFile = _findfirst((dir + "*.pgm").c_str(), &findData);
+	for (const auto& entry : it)
+	{
+		if (entry.is_regular_file(error) && entry.path().extension() == ".pgm")
+			// discard ".pgm", keep the directory as given
+			names.push_back(dir + entry.path().stem().string());
+	}
+	std::sort(names.begin(), names.end());
+	// confine the maximum size of the data set
+	if (max >= 0 && static_cast<int>(names.size()) > max)
+		names.resize(max);
+	return names;
+}
 
-	int count = 0;
+std::vector<DataObject> ImageReader::loadDataSet(const std::string& dir, int max)
+{
+	std::vector<DataObject> dataSet;
 
-	do
+	for (const auto& imagePath : findPgmFiles(dir, max))
 	{
-		// confine the maximum size of the data set
-		if (count == max) break;
-		count++;
-
-		std::string imagePath = dir + findData.name;
-		// discard ".pgm"
-		imagePath = imagePath.substr(0, imagePath.size() - 4);
 		DataObject obj = loadFile(imagePath);
 
 		// cv::imread doesn't throws exception, but the return mat is empty
@@ -77,10 +88,7 @@ std::vector<DataObject> ImageReader::loadDataSet(const std::string& dir, int max
 			continue;
 		}
 		dataSet.push_back(obj);
-
-	} while (_findnext(hFile, &findData) == 0);
-
-	_findclose(hFile);
+	}
 
 	if (dataSet.empty())
 	{
@@ -90,6 +98,40 @@ std::vector<DataObject> ImageReader::loadDataSet(const std::string& dir, int max
 	return dataSet;
 }
 
+std::vector<std::string> ImageReader::listDataSet(const std::string& dir, int max)
+{
+	std::vector<std::string> names = findPgmFiles(dir, max);
+	if (names.empty())
+		std::cout << "Cannot find any data in " + dir << std::endl;
+	return names;
+}
+
+std::string ImageReader::parseIdentity(const std::string& filename)
+{
+	size_t begin = filename.find_last_of("\\/");
+	begin = begin == std::string::npos ? 0 : begin + 1;
+	size_t end = filename.find_last_of('_');
+	if (end == std::string::npos || end < begin)
+		end = filename.size();
+	return filename.substr(begin, end - begin);
+}
+
+std::map<std::string, std::string> ImageReader::loadIdentityManifest(const std::string& path)
+{
+	std::map<std::string, std::string> identities;
+	std::fstream manifest(path, std::ios::in);
+	if (!manifest.is_open())
+	{
+		std::cout << "Cannot open identity manifest " + path << std::endl;
+		return identities;
+	}
+	std::string name, identity;
+	while (manifest >> name >> identity)
+		identities[name] = identity;
+	manifest.close();
+	return identities;
+}
+
 void ImageReader::writeDataSet(const std::string& dir, const std::vector<DataObject>& dataset)
 {
 	for (int i = 0; i < dataset.size(); ++i)
@@ -0,0 +1,165 @@
+#include "IvfIndex.h"
+#include "NearestSearch.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+
+// k-means runs on a sample of the gallery, this many rows per list is enough for stable centroids
+constexpr int TrainRowsPerList = 256;
+// rows assigned to their lists by one gemm
+constexpr int AssignBlockRows = 16384;
+
+void IvfIndex::build(const cv::Mat& gallery, int listNum)
+{
+	CV_Assert(gallery.type() == CV_32FC1);
+	clear();
+	if (gallery.empty())
+		return;
+
+	if (listNum <= 0)
+		listNum = static_cast<int>(std::sqrt(static_cast<double>(gallery.rows)));
+	listNum = std::max(1, std::min(listNum, gallery.rows));
+
+	// sample the rows to cluster
+	cv::Mat samples = gallery;
+	if (gallery.rows > listNum * TrainRowsPerList)
+	{
+		std::vector<int> order(gallery.rows);
+		std::iota(order.begin(), order.end(), 0);
+		cv::RNG rng(0x1f1f);
+		cv::randShuffle(order, 1, &rng);
+		samples.create(listNum * TrainRowsPerList, gallery.cols, CV_32FC1);
+		for (int i = 0; i < samples.rows; ++i)
+			gallery.row(order[i]).copyTo(samples.row(i));
+	}
+
+	cv::Mat labels;
+	cv::kmeans(samples, listNum, labels, cv::TermCriteria(cv::TermCriteria::COUNT | cv::TermCriteria::EPS, 20, 1e-3),
+		1, cv::KMEANS_PP_CENTERS, centroids);
+	centroidNorm = NearestSearch::calRowSqrNorm(centroids);
+
+	// assign every row to its nearest centroid: argmin |c|^2 - 2xc
+	std::vector<int> assignment(gallery.rows);
+	int blocks = (gallery.rows + AssignBlockRows - 1) / AssignBlockRows;
+	cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range& range)
+		{
+			for (int b = range.start; b < range.end; ++b)
+			{
+				int begin = b * AssignBlockRows;
+				int end = std::min(begin + AssignBlockRows, gallery.rows);
+				cv::Mat dots;
+				cv::gemm(gallery.rowRange(begin, end), centroids, 1, cv::noArray(), 0, dots, cv::GEMM_2_T);
+				for (int i = 0; i < dots.rows; ++i)
+				{
+					auto p = dots.ptr<float>(i);
+					int best = 0;
+					float bestDist = centroidNorm.at<float>(0) - 2 * p[0];
+					for (int c = 1; c < dots.cols; ++c)
+					{
+						float dist = centroidNorm.at<float>(c) - 2 * p[c];
+						if (dist < bestDist)
+						{
+							bestDist = dist;
+							best = c;
+						}
+					}
+					assignment[begin + i] = best;
+				}
+			}
+		});
+
+	// counting sort the rows by list
+	offsets.assign(listNum + 1, 0);
+	for (int a : assignment)
+		offsets[a + 1]++;
+	for (int i = 0; i < listNum; ++i)
+		offsets[i + 1] += offsets[i];
+	ids.resize(gallery.rows);
+	std::vector<int> cursor(offsets.begin(), offsets.end() - 1);
+	for (int i = 0; i < gallery.rows; ++i)
+		ids[cursor[assignment[i]]++] = i;
+
+	gather(gallery);
+}
+
+void IvfIndex::gather(const cv::Mat& gallery)
+{
+	vectors.create(static_cast<int>(ids.size()), gallery.cols, CV_32FC1);
+	for (int i = 0; i < vectors.rows; ++i)
+		gallery.row(ids[i]).copyTo(vectors.row(i));
+	vectorNorm = NearestSearch::calRowSqrNorm(vectors);
+}
+
+std::vector<Match> IvfIndex::search(const cv::Mat& query, int k, int probeNum) const
+{
+	std::vector<Match> lists = NearestSearch::findNearest(centroids, centroidNorm, query, probeNum);
+
+	std::vector<Match> matches;
+	for (auto& list : lists)
+	{
+		int begin = offsets[list.index];
+		int end = offsets[list.index + 1];
+		if (begin == end)
+			continue;
+		auto listMatches = NearestSearch::findNearest(vectors.rowRange(begin, end), vectorNorm.rowRange(begin, end), query, k);
+		for (auto& m : listMatches)
+			matches.push_back({ ids[begin + m.index], m.dist });
+	}
+
+	auto byDist = [](const Match& a, const Match& b) { return a.dist < b.dist; };
+	if (matches.size() > static_cast<size_t>(k))
+	{
+		std::partial_sort(matches.begin(), matches.begin() + k, matches.end(), byDist);
+		matches.resize(k);
+	}
+	else
+		std::sort(matches.begin(), matches.end(), byDist);
+	return matches;
+}
+
+void IvfIndex::clear()
+{
+	centroids.release();
+	centroidNorm.release();
+	offsets.clear();
+	ids.clear();
+	vectors.release();
+	vectorNorm.release();
+}
+
+void IvfIndex::wrap(const cv::Mat& centroids, const std::vector<int>& offsets, const std::vector<int>& ids, const cv::Mat& vectors, const cv::Mat& vectorNorm)
+{
+	clear();
+	this->centroids = centroids;
+	this->offsets = offsets;
+	this->ids = ids;
+	this->vectors = vectors;
+	this->vectorNorm = vectorNorm;
+	centroidNorm = NearestSearch::calRowSqrNorm(centroids);
+}
+
+void IvfIndex::write(cv::FileStorage& fs) const
+{
+	fs << "IvfCentroids" << centroids;
+	fs << "IvfOffsets" << offsets;
+	fs << "IvfIds" << ids;
+}
+
+void IvfIndex::read(const cv::FileStorage& fs, const cv::Mat& gallery)
+{
+	clear();
+	fs["IvfCentroids"] >> centroids;
+	if (centroids.empty())
+		return;
+	fs["IvfOffsets"] >> offsets;
+	fs["IvfIds"] >> ids;
+	if (static_cast<int>(ids.size()) != gallery.rows || static_cast<int>(offsets.size()) != centroids.rows + 1)
+	{
+		// the index doesn't belong to these weights
+		clear();
+		return;
+	}
+	centroidNorm = NearestSearch::calRowSqrNorm(centroids);
+	gather(gallery);
+}
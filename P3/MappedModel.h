@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+
+/*
+ * Read-only memory mapping of a whole file.
+ * Every process mapping the same file shares the same physical pages.
+ */
+class MappedFile
+{
+	const unsigned char* base = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	void* fileHandle = nullptr;
+	void* mappingHandle = nullptr;
+#else
+	int fd = -1;
+#endif
+public:
+	MappedFile() = default;
+	~MappedFile() { close(); }
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const std::string& path);
+	void close();
+
+	const unsigned char* data() const { return base; }
+	size_t size() const { return length; }
+};
+
+constexpr char MappedModelMagic[4] = { 'E', 'I', 'G', 'F' };
+constexpr int32_t MappedModelVersion = 2;
+// every section starts at a multiple of this, so SIMD loads of a row never straddle a cache line at the start
+constexpr uint64_t MappedModelAlign = 64;
+
+/*
+ * Header of the flat model file written by TrainDataSet::exportMappedModel.
+ * Offsets are in bytes from the beginning of the file, 0 when the section is absent.
+ */
+struct MappedModelHeader
+{
+	char magic[4];
+	int32_t version;
+	// size of the average image
+	int32_t rows, cols;
+	int32_t eigenNum, imageNum;
+	// Precision of the basis
+	int32_t precision;
+	// lists of the ivf index, 0 when there is no index
+	int32_t listNum;
+	// identity templates, 0 when they are disabled, and the number of identities reranked image by image
+	int32_t templateNum, templateRerank;
+
+	// rows * cols uchar
+	uint64_t avgOffset;
+	// eigen_num * pixel_num in the precision of the basis, and eigen_num float scales for int8
+	uint64_t basisOffset, scaleOffset;
+	// image_num * eigen_num float weights, image_num float squared norms
+	uint64_t weightOffset, normOffset;
+	// list_num * eigen_num float centroids, list_num + 1 int32 offsets, image_num int32 ids,
+	// image_num * eigen_num float weights reordered by list, image_num float squared norms
+	uint64_t centroidOffset, listOffset, idOffset, vectorOffset, vectorNormOffset;
+	// image_num + 1 uint64 offsets into the characters of the image names
+	uint64_t nameOffset, charOffset;
+	// image_num + 1 uint64 offsets into the characters of the identities of the images
+	uint64_t identityOffset, identityCharOffset;
+	// template_num * eigen_num float class means, template_num float squared norms, template_num int32 medoid images,
+	// template_num + 1 int32 offsets into image_num int32 images grouped by identity
+	uint64_t templateOffset, templateNormOffset, templateImageOffset, memberListOffset, memberOffset;
+	uint64_t totalSize;
+};
@@ -1,53 +1,91 @@
-#include <opencv2/highgui.hpp>
 #include <iostream>
 #include "TrainDataSet.h"
+#include "ImageReader.h"
 
 
 int main(int argc, char** argv)
 {
 	if (argc < 4)
 	{
-		std::cout << "Usage: mytrain [SrcCount] [ModelPath] [DataPath]\n";
+		std::cout << "Usage: mytrain [SrcCount] [ModelPath] [DataPath] [optional:Update] [optional:IndexLists] [optional:OutOfCore] [optional:Precision] [optional:EigenFacePath] [optional:Templates]\n";
 		std::cout << "SrcCount: The number of source image imported to train\n";
 		std::cout << "ModelPath: The path of extracted model file\n";
 		std::cout << "DataPath: The path of training data set\n";
+		std::cout << "Update(default n): y/n, if y, the images in DataPath are folded into the existing model instead of training a new one\n";
+		std::cout << "IndexLists(default -1): The number of lists of the approximate search index saved with the model, 0 for sqrt(SrcCount), no index when negative\n";
+		std::cout << "OutOfCore(default 0): If positive, train without loading the data set into memory, keeping this many eigen faces. The preprocessed faces are spilled to ModelPath\n";
+		std::cout << "Precision(default fp32): fp32/fp16/int8, the precision of the eigen faces saved in the model\n";
+		std::cout << "EigenFacePath: If given, the first 10 eigen faces are written to this image, e.g. eigenfaces.png\n";
+		std::cout << "Templates(default n): n/y/ManifestPath, if not n, one class-mean template per identity is searched instead of every image\n";
+		std::cout << "    with y the identity is the file name up to the last '_', a manifest has one \"[ImageName] [Identity]\" per line\n";
 		return -1;
 	}
 	int srcCount = std::stoi(argv[1]);
 	std::string modelPath = argv[2];
 	std::string dataPath = argv[3];
+	bool update = argc >= 5 && std::string(argv[4]) == "y";
+	std::string eigenFacePath = argc >= 9 ? argv[8] : "";
+	std::string templates = argc >= 10 ? argv[9] : "n";
+	Precision precision = Precision::FP32;
+	if (argc >= 8)
+	{
+		std::string p = argv[7];
+		if (p == "fp16")
+			precision = Precision::FP16;
+		else if (p == "int8")
+			precision = Precision::INT8;
+	}
 
 	TrainDataSet data_set;
-	data_set.loadDataSet(dataPath, srcCount);
-	data_set.train();
-	data_set.saveModel(modelPath);
-
-	auto eigenFaces = data_set.outputEigenFace(srcCount > 10 ? 10 : srcCount);
-	cv::Mat superEigenFace = eigenFaces[0];
-	for (int i = 1; i < 5 && i < eigenFaces.size(); ++i)
+	if (update)
 	{
-		cv::hconcat(superEigenFace, eigenFaces[i], superEigenFace);
-	}
-	if (eigenFaces.size() >= 5) {
-		cv::Mat superEigenFace2 = eigenFaces[5];
-		for (int i = 6; i < eigenFaces.size(); ++i)
-		{
-			cv::hconcat(superEigenFace2, eigenFaces[i], superEigenFace2);
-		}
-		cv::Mat black(eigenFaces[0].rows, eigenFaces[0].cols, CV_8UC1, cv::Scalar{ 0,0,0 });
-		for (int i = eigenFaces.size(); i < 10; ++i)
+		data_set.loadModel(modelPath);
+		// a model trained out of core is retrained from the files when the update drifts too far
+		data_set.setScratchPath(modelPath + "faces.scratch");
+		if (argc >= 6)
+			data_set.useIndex(std::stoi(argv[5]));
+		if (templates != "n")
 		{
-			cv::hconcat(superEigenFace2, black, superEigenFace2);
+			if (templates != "y")
+				data_set.setIdentityManifest(templates);
+			data_set.useTemplates();
 		}
-		cv::vconcat(superEigenFace, superEigenFace2, superEigenFace);
+		data_set.update(ImageReader::loadDataSet(dataPath, srcCount));
+		if (argc >= 8)
+			data_set.setPrecision(precision);
+		data_set.saveModel(modelPath);
+		if (!eigenFacePath.empty())
+			data_set.exportEigenFaces(eigenFacePath);
+		return 0;
+	}
+
+	if (argc >= 6)
+		data_set.useIndex(std::stoi(argv[5]));
+	if (templates != "n")
+	{
+		if (templates != "y")
+			data_set.setIdentityManifest(templates);
+		data_set.useTemplates();
 	}
 
-	cv::imshow("Eigenfaces", superEigenFace);
+	int outOfCore = argc >= 7 ? std::stoi(argv[6]) : 0;
+	if (outOfCore > 0)
+	{
+		data_set.trainOutOfCore(dataPath, srcCount, outOfCore, modelPath + "faces.scratch");
+	}
+	else
+	{
+		data_set.loadDataSet(dataPath, srcCount);
+		data_set.train();
+	}
 
+	data_set.setPrecision(precision);
+	data_set.saveModel(modelPath);
+	if (!eigenFacePath.empty())
+		data_set.exportEigenFaces(eigenFacePath);
 
 	//data_set.saveAllImages(".\\images_face\\");
 	//data_set.saveAllRawImages(".\\images_raw\\");
 
-	cv::waitKey();
-
+	return 0;
 }
@@ -0,0 +1,46 @@
+#pragma once
+#include <opencv2/imgproc.hpp>
+#include <string>
+#include <vector>
+
+// Eye Position structure
+struct EyePos
+{
+	int LeftX, LeftY;
+	int RightX, RightY;
+	bool operator==(const EyePos& ep) const
+	{
+		return LeftX == ep.LeftX && LeftY == ep.LeftY && RightX == ep.RightX && RightY == ep.RightY;
+	}
+};
+
+// Data Object in data set
+struct DataObject
+{
+	EyePos eye;
+	cv::Mat image;
+	std::string filename;
+	// the person in the image, unknown when empty
+	std::string identity;
+};
+
+// Training image matched by a probe
+struct Match
+{
+	// index of the image in the training set
+	int index;
+	// euclid dist between the weights
+	double dist;
+};
+
+// Recognition result of one image
+struct RecognizeResult
+{
+	std::string filename;
+	// false when no face can be located in the image
+	bool valid;
+	// sorted by dist, the first one is the most similar image
+	std::vector<Match> matches;
+};
+
+constexpr EyePos InvalidEyePos{ -1,-1,-1,-1 };
\ No newline at end of file
@@ -0,0 +1,35 @@
+#include "FaceDetector.h"
+#include <algorithm>
+
+
+FaceDetector::FaceDetector(const std::string& path, const DetectorParams& params) : params(params)
+{
+	cascade.open(path, cv::FileStorage::READ);
+	if (!cascade.isOpened())
+		return;
+
+	// make sure the cascade is valid before any thread relies on it
+	cv::CascadeClassifier classifier;
+	loaded = classifier.read(cascade.getFirstTopLevelNode());
+	if (!loaded)
+		cascade.release();
+}
+
+std::vector<cv::Rect> FaceDetector::detect(const cv::Mat& gray) const
+{
+	std::vector<cv::Rect> faces;
+	if (!loaded)
+		return faces;
+
+	cv::CascadeClassifier* classifier = classifiers.get();
+	if (classifier->empty())
+	{
+		std::lock_guard<std::mutex> lock(cascadeMutex);
+		classifier->read(cascade.getFirstTopLevelNode());
+	}
+
+	classifier->detectMultiScale(gray, faces, params.scaleFactor, params.minNeighbors, 0, params.minSize, params.maxSize);
+	std::sort(faces.begin(), faces.end(), [](const cv::Rect& a, const cv::Rect& b) { return a.area() > b.area(); });
+
+	return faces;
+}
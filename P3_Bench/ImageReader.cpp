@@ -0,0 +1,141 @@
+#include "ImageReader.h"
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#include <opencv2/highgui.hpp>
+
+
+
+cv::Mat loadImage(const std::string& filename) noexcept
+{
+	cv::Mat imgmat = cv::imread(filename + ".pgm", cv::IMREAD_GRAYSCALE);
+
+	return imgmat;
+}
+
+EyePos loadEyePos(const std::string& filename)
+{
+	std::fstream eps(filename + ".eye", std::ios::in);
+	if (!eps.is_open())
+		return InvalidEyePos;
+	EyePos ep;
+	std::string temp;
+
+	// .eye format:
+	// #LX 	LY	RX	RY
+	// 232 	110	161	110
+	std::getline(eps, temp);
+	eps >> ep.RightX >> ep.RightY >> ep.LeftX >> ep.LeftY;
+
+	eps.close();
+
+	return ep;
+}
+
+DataObject ImageReader::loadFile(const std::string& filename)
+{
+	DataObject obj;
+
+	obj.image = loadImage(filename);
+	obj.eye = loadEyePos(filename);
+	obj.filename = filename;
+	obj.identity = parseIdentity(filename);
+
+	return obj;
+}
+
+// paths of the pgm files in dir without the suffix, in name order
+std::vector<std::string> findPgmFiles(const std::string& dir, int max)
+{
+	std::vector<std::string> names;
+	std::error_code error;
+	std::filesystem::directory_iterator it(dir, error);
+	if (error)
+		return names;
+
+	for (const auto& entry : it)
+	{
+		if (entry.is_regular_file(error) && entry.path().extension() == ".pgm")
+			// discard ".pgm", keep the directory as given
+			names.push_back(dir + entry.path().stem().string());
+	}
+	std::sort(names.begin(), names.end());
+	// confine the maximum size of the data set
+	if (max >= 0 && static_cast<int>(names.size()) > max)
+		names.resize(max);
+	return names;
+}
+
+std::vector<DataObject> ImageReader::loadDataSet(const std::string& dir, int max)
+{
+	std::vector<DataObject> dataSet;
+
+	for (const auto& imagePath : findPgmFiles(dir, max))
+	{
+		DataObject obj = loadFile(imagePath);
+
+		// cv::imread doesn't throws exception, but the return mat is empty
+		if (obj.image.empty())
+		{
+			std::cout << "Cannot open data " + imagePath + ".pgm\n";
+			continue;
+		}
+		// when no eye file found, obj.eye will be set to InvalidEyePos
+		if (obj.eye == InvalidEyePos)
+		{
+			std::cout << "Cannot open data " + imagePath + ".eye\n";
+			continue;
+		}
+		dataSet.push_back(obj);
+	}
+
+	if (dataSet.empty())
+	{
+		std::cout << "Cannot find any data in " + dir << std::endl;
+	}
+
+	return dataSet;
+}
+
+std::vector<std::string> ImageReader::listDataSet(const std::string& dir, int max)
+{
+	std::vector<std::string> names = findPgmFiles(dir, max);
+	if (names.empty())
+		std::cout << "Cannot find any data in " + dir << std::endl;
+	return names;
+}
+
+std::string ImageReader::parseIdentity(const std::string& filename)
+{
+	size_t begin = filename.find_last_of("\\/");
+	begin = begin == std::string::npos ? 0 : begin + 1;
+	size_t end = filename.find_last_of('_');
+	if (end == std::string::npos || end < begin)
+		end = filename.size();
+	return filename.substr(begin, end - begin);
+}
+
+std::map<std::string, std::string> ImageReader::loadIdentityManifest(const std::string& path)
+{
+	std::map<std::string, std::string> identities;
+	std::fstream manifest(path, std::ios::in);
+	if (!manifest.is_open())
+	{
+		std::cout << "Cannot open identity manifest " + path << std::endl;
+		return identities;
+	}
+	std::string name, identity;
+	while (manifest >> name >> identity)
+		identities[name] = identity;
+	manifest.close();
+	return identities;
+}
+
+void ImageReader::writeDataSet(const std::string& dir, const std::vector<DataObject>& dataset)
+{
+	for (int i = 0; i < dataset.size(); ++i)
+	{
+		cv::imwrite(dir + std::to_string(i) + ".jpg", dataset[i].image);
+	}
+}
@@ -0,0 +1,83 @@
+#include "MappedModel.h"
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+bool MappedFile::open(const std::string& path)
+{
+	close();
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr)
+	{
+		CloseHandle(file);
+		return false;
+	}
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (view == nullptr)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	fileHandle = file;
+	mappingHandle = mapping;
+	base = static_cast<const unsigned char*>(view);
+	length = static_cast<size_t>(fileSize.QuadPart);
+#else
+	int file = ::open(path.c_str(), O_RDONLY);
+	if (file < 0)
+		return false;
+	struct stat st;
+	if (fstat(file, &st) != 0 || st.st_size == 0)
+	{
+		::close(file);
+		return false;
+	}
+	void* view = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, file, 0);
+	if (view == MAP_FAILED)
+	{
+		::close(file);
+		return false;
+	}
+	fd = file;
+	base = static_cast<const unsigned char*>(view);
+	length = static_cast<size_t>(st.st_size);
+#endif
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (base == nullptr)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(base);
+	CloseHandle(mappingHandle);
+	CloseHandle(fileHandle);
+	mappingHandle = nullptr;
+	fileHandle = nullptr;
+#else
+	munmap(const_cast<unsigned char*>(base), length);
+	::close(fd);
+	fd = -1;
+#endif
+	base = nullptr;
+	length = 0;
+}
@@ -0,0 +1,147 @@
+#include "NearestSearch.h"
+#include <opencv2/core/hal/intrin.hpp>
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <queue>
+
+
+// rows handled by one parallel task, big enough to hide the scheduling cost
+constexpr int BlockRows = 4096;
+
+// max heap on dist, the top is the worst one of the best k matches
+using MatchHeap = std::priority_queue<std::pair<float, int>>;
+
+void pushMatch(MatchHeap& heap, int k, float dist, int index)
+{
+	if (heap.size() < static_cast<size_t>(k))
+		heap.emplace(dist, index);
+	else if (dist < heap.top().first)
+	{
+		heap.pop();
+		heap.emplace(dist, index);
+	}
+}
+
+// dot products of 4 gallery rows with the query, sharing the loads of the query
+void dot4(const float* q, const float* p0, const float* p1, const float* p2, const float* p3, int len, float* out)
+{
+	int j = 0;
+	float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+#if CV_SIMD
+	const int lanes = cv::v_float32::nlanes;
+	cv::v_float32 v0 = cv::vx_setzero_f32(), v1 = cv::vx_setzero_f32(),
+		v2 = cv::vx_setzero_f32(), v3 = cv::vx_setzero_f32();
+	for (; j <= len - lanes; j += lanes)
+	{
+		cv::v_float32 vq = cv::vx_load(q + j);
+		v0 = cv::v_fma(cv::vx_load(p0 + j), vq, v0);
+		v1 = cv::v_fma(cv::vx_load(p1 + j), vq, v1);
+		v2 = cv::v_fma(cv::vx_load(p2 + j), vq, v2);
+		v3 = cv::v_fma(cv::vx_load(p3 + j), vq, v3);
+	}
+	s0 = cv::v_reduce_sum(v0);
+	s1 = cv::v_reduce_sum(v1);
+	s2 = cv::v_reduce_sum(v2);
+	s3 = cv::v_reduce_sum(v3);
+#endif
+	for (; j < len; ++j)
+	{
+		s0 += p0[j] * q[j];
+		s1 += p1[j] * q[j];
+		s2 += p2[j] * q[j];
+		s3 += p3[j] * q[j];
+	}
+	out[0] = s0;
+	out[1] = s1;
+	out[2] = s2;
+	out[3] = s3;
+}
+
+float dot1(const float* q, const float* p, int len)
+{
+	int j = 0;
+	float s = 0;
+#if CV_SIMD
+	const int lanes = cv::v_float32::nlanes;
+	cv::v_float32 v = cv::vx_setzero_f32();
+	for (; j <= len - lanes; j += lanes)
+		v = cv::v_fma(cv::vx_load(p + j), cv::vx_load(q + j), v);
+	s = cv::v_reduce_sum(v);
+#endif
+	for (; j < len; ++j)
+		s += p[j] * q[j];
+	return s;
+}
+
+cv::Mat NearestSearch::calRowSqrNorm(const cv::Mat& mat)
+{
+	CV_Assert(mat.type() == CV_32FC1);
+
+	cv::Mat norm(mat.rows, 1, CV_32FC1);
+	auto pNorm = norm.ptr<float>();
+	for (int i = 0; i < mat.rows; ++i)
+	{
+		auto p = mat.ptr<float>(i);
+		pNorm[i] = dot1(p, p, mat.cols);
+	}
+	return norm;
+}
+
+std::vector<Match> NearestSearch::findNearest(const cv::Mat& gallery, const cv::Mat& galleryNorm, const cv::Mat& query, int k)
+{
+	CV_Assert(gallery.type() == CV_32FC1 && galleryNorm.type() == CV_32FC1 && query.type() == CV_32FC1);
+	CV_Assert(static_cast<int>(query.total()) == gallery.cols && galleryNorm.rows == gallery.rows);
+
+	k = std::min(k, gallery.rows);
+	if (k <= 0)
+		return {};
+
+	// the query may be a col vector, make it one continuous row
+	cv::Mat q = query.isContinuous() ? query.reshape(1, 1) : query.clone().reshape(1, 1);
+	auto pQuery = q.ptr<float>();
+	float queryNorm = dot1(pQuery, pQuery, q.cols);
+	auto pNorm = galleryNorm.ptr<float>();
+	int len = gallery.cols;
+
+	MatchHeap best;
+	std::mutex bestMutex;
+
+	int blocks = (gallery.rows + BlockRows - 1) / BlockRows;
+	cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range& range)
+		{
+			MatchHeap local;
+			float dots[4];
+			for (int b = range.start; b < range.end; ++b)
+			{
+				int begin = b * BlockRows;
+				int end = std::min(begin + BlockRows, gallery.rows);
+				int i = begin;
+				for (; i + 4 <= end; i += 4)
+				{
+					dot4(pQuery, gallery.ptr<float>(i), gallery.ptr<float>(i + 1),
+						gallery.ptr<float>(i + 2), gallery.ptr<float>(i + 3), len, dots);
+					for (int t = 0; t < 4; ++t)
+						pushMatch(local, k, queryNorm + pNorm[i + t] - 2 * dots[t], i + t);
+				}
+				for (; i < end; ++i)
+					pushMatch(local, k, queryNorm + pNorm[i] - 2 * dot1(pQuery, gallery.ptr<float>(i), len), i);
+			}
+
+			std::lock_guard<std::mutex> lock(bestMutex);
+			while (!local.empty())
+			{
+				pushMatch(best, k, local.top().first, local.top().second);
+				local.pop();
+			}
+		});
+
+	std::vector<Match> matches(best.size());
+	for (int i = static_cast<int>(matches.size()) - 1; i >= 0; --i)
+	{
+		// the expansion may go slightly negative through rounding
+		matches[i] = { best.top().second, std::sqrt(std::max(best.top().first, 0.0f)) };
+		best.pop();
+	}
+	return matches;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <vector>
+#include "DataStruct.h"
+
+
+class NearestSearch
+{
+public:
+	/*
+	 * Calculate the squared L2 norm of every row.
+	 * @param mat CV_32FC1 mat, one sample per row
+	 * @return rows * 1 CV_32FC1 mat
+	 */
+	static cv::Mat calRowSqrNorm(const cv::Mat& mat);
+
+	/*
+	 * Find the k rows of gallery nearest to query, sorted by dist.
+	 * The dist is expanded as |a|^2 + |b|^2 - 2ab, so the norms of the gallery rows are only computed once.
+	 * @param gallery CV_32FC1 mat, one sample per row
+	 * @param galleryNorm squared norms of the gallery rows, from calRowSqrNorm
+	 * @param query CV_32FC1 mat with one row, or one col, of the same length as the gallery rows
+	 * @param k the number of matches returned, all rows when k is bigger than gallery rows
+	 */
+	static std::vector<Match> findNearest(const cv::Mat& gallery, const cv::Mat& galleryNorm, const cv::Mat& query, int k);
+};
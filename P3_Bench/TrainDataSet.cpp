@@ -0,0 +1,1558 @@
+#include "TrainDataSet.h"
+#include "ImageReader.h"
+#include "NearestSearch.h"
+#include "FaceDetector.h"
+#include "MappedModel.h"
+#include <opencv2/objdetect.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/highgui.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+#include <iostream>
+#include <fstream>
+#include <functional>
+#include <cstdio>
+#include <algorithm>
+#include <cfloat>
+
+
+void TrainDataSet::loadDataSet(const std::string& dir, int max)
+{
+	raw = ImageReader::loadDataSet(dir, max);
+}
+
+void TrainDataSet::saveAllRawImages(const std::string& dir) const
+{
+	ImageReader::writeDataSet(dir, raw);
+}
+
+void TrainDataSet::saveAllImages(const std::string& dir) const
+{
+	ImageReader::writeDataSet(dir, data);
+}
+
+
+cv::Rect applyEyeFaceTemplate(const cv::Mat& image, const EyePos& eyePos)
+{
+
+	// eye-face template
+	// L eye :59 75 R eye : 130 75 Face : 186 186
+
+	cv::Point2d left(eyePos.LeftX, eyePos.LeftY), right(eyePos.RightX, eyePos.RightY);
+
+	cv::Point2d mid((left.x + right.x) / 2, (left.y + right.y) / 2);
+	// euclid dist
+	double dist = std::sqrt(std::pow((right.x - left.x), 2) + std::pow((right.y - left.y), 2));
+	int templateDist = 130 - 59;
+	double rate = dist / templateDist;
+
+	cv::Point2d leftTop(eyePos.LeftX - 59 * rate, eyePos.LeftY - 75 * rate),
+		RightBottom(eyePos.RightX + (186 - 130) * rate, eyePos.RightY + (186 - 75) * rate);
+
+	// fix out-of-range, while keeping the rect is a square
+
+	if (leftTop.y < 0)
+	{
+		// no forehead in the image
+		int oor = -leftTop.y;
+		leftTop.y = 0;
+		leftTop.x += oor / 2;
+		RightBottom.x -= oor / 2;
+	}
+
+	if (RightBottom.y > image.rows)
+	{
+		int oor = RightBottom.y - image.rows;
+		RightBottom.y = image.rows;
+		leftTop.x += oor / 2;
+		RightBottom.x -= oor / 2;
+	}
+	if (leftTop.x < 0)
+	{
+		int oor = -leftTop.x;
+		leftTop.x = 0;
+		leftTop.y += oor;
+		RightBottom.x -= oor;
+		RightBottom.y -= oor;
+	}
+	if (RightBottom.x > image.cols)
+	{
+		int oor = RightBottom.x - image.cols;
+		RightBottom.x = image.cols;
+		leftTop.x += oor;
+		leftTop.y -= oor;
+		RightBottom.y -= oor;
+	}
+
+	return cv::Rect(leftTop, RightBottom);
+}
+
+// locate the face of a sample, with the eye-face template when the eyes are known, otherwise with the classifier
+// return an empty rect when no face can be located
+cv::Rect locateFace(const FaceDetector& detector, const DataObject& obj, bool useCasClassifier)
+{
+	if (obj.image.empty())
+		return cv::Rect();
+
+	// the eyes align the face tighter than any detected rect, the classifier is not needed at all
+	cv::Rect face;
+	if (!(obj.eye == InvalidEyePos))
+		face = applyEyeFaceTemplate(obj.image, obj.eye);
+	else if (useCasClassifier)
+	{
+		// normally there should be only one face
+		std::vector<cv::Rect> faces = detector.detect(obj.image);
+		if (!faces.empty())
+			face = faces.at(0);
+	}
+
+	// the template may slightly run out of the image by rounding
+	return face & cv::Rect(0, 0, obj.image.cols, obj.image.rows);
+}
+
+/*
+ * Similarity transform from the image to a face of the given size.
+ * When the eyes are known, they are rotated, scaled and moved onto the eyes of the eye-face template,
+ * which corrects the roll of the head. Otherwise the face rect is scaled to the size.
+ */
+cv::Mat alignTransform(const DataObject& obj, const cv::Rect& face, const cv::Size& size)
+{
+	if (obj.eye == InvalidEyePos)
+	{
+		double sx = static_cast<double>(size.width) / face.width, sy = static_cast<double>(size.height) / face.height;
+		return (cv::Mat_<double>(2, 3) << sx, 0, -face.x * sx, 0, sy, -face.y * sy);
+	}
+
+	// template eyes (59, 75) and (130, 75) of a 186 * 186 face
+	cv::Point2d dstLeft(59.0 * size.width / 186, 75.0 * size.height / 186), dstRight(130.0 * size.width / 186, 75.0 * size.height / 186);
+	cv::Point2d srcLeft(obj.eye.LeftX, obj.eye.LeftY), srcRight(obj.eye.RightX, obj.eye.RightY);
+
+	cv::Point2d src = srcRight - srcLeft, dst = dstRight - dstLeft;
+	double scale = std::sqrt(dst.dot(dst) / std::max(src.dot(src), 1.0));
+	double angle = std::atan2(dst.y, dst.x) - std::atan2(src.y, src.x);
+	double a = scale * std::cos(angle), b = scale * std::sin(angle);
+	// dstLeft = R * srcLeft + t
+	return (cv::Mat_<double>(2, 3) << a, -b, dstLeft.x - (a * srcLeft.x - b * srcLeft.y),
+		b, a, dstLeft.y - (b * srcLeft.x + a * srcLeft.y));
+}
+
+// crop, rotate and resize the face in one warp, then make the pixel value distribution more normal
+cv::Mat normalizeFace(const DataObject& obj, const cv::Rect& face, const cv::Size& size)
+{
+	cv::Mat faceImage;
+	cv::warpAffine(obj.image, faceImage, alignTransform(obj, face, size), size, cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+	cv::equalizeHist(faceImage, faceImage);
+
+	return faceImage;
+}
+
+// locate and normalize the face of a sample, return an empty mat when no face can be located
+cv::Mat extractFace(const FaceDetector& detector, const DataObject& obj, bool useCasClassifier, const cv::Size& size)
+{
+	cv::Rect face = locateFace(detector, obj, useCasClassifier);
+	if (face.empty())
+		return cv::Mat();
+	return normalizeFace(obj, face, size);
+}
+
+void TrainDataSet::preprocess(bool useCasClassifier)
+{
+	if (useCasClassifier && faceDetector->empty())
+	{
+		std::cout << "Face cascade classifier not found. Will use eye-face template instead.\n";
+		useCasClassifier = false;
+	}
+
+	int n = raw.size();
+	std::vector<cv::Rect> faces(n);
+	data.assign(n, DataObject());
+
+	// align, resize and equalize one sample, the face rect of which is known
+	auto normalize = [this, &faces](int i, const cv::Size& size)
+	{
+		const DataObject& obj = raw[i];
+
+		// map EyePos to the face coordination
+		EyePos newEyePos = InvalidEyePos;
+		if (!(obj.eye == InvalidEyePos))
+		{
+			std::vector<cv::Point2d> eyes = { cv::Point2d(obj.eye.LeftX, obj.eye.LeftY), cv::Point2d(obj.eye.RightX, obj.eye.RightY) };
+			cv::transform(eyes, eyes, alignTransform(obj, faces[i], size));
+			newEyePos = { cvRound(eyes[0].x), cvRound(eyes[0].y), cvRound(eyes[1].x), cvRound(eyes[1].y) };
+		}
+
+		data[i] = DataObject{ newEyePos, normalizeFace(obj, faces[i], size), obj.filename, obj.identity };
+	};
+
+	// one stripe per sample, detection time varies a lot between images
+	if (canonicalSize.area() > 0)
+	{
+		// the size is fixed, every sample goes through the whole pipeline at once
+		cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& range)
+			{
+				for (int i = range.start; i < range.end; ++i)
+				{
+					faces[i] = locateFace(*faceDetector, raw[i], useCasClassifier);
+					if (!faces[i].empty())
+						normalize(i, canonicalSize);
+				}
+			}, n);
+	}
+	else
+	{
+		// the average size is needed before any face can be resized, so detect first
+		cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& range)
+			{
+				for (int i = range.start; i < range.end; ++i)
+					faces[i] = locateFace(*faceDetector, raw[i], useCasClassifier);
+			}, n);
+	}
+
+	// drop the samples without a face from raw as well, so that raw and data keep the same order
+	int kept = 0;
+	int avgWidth = 0, avgHeight = 0;
+	for (int i = 0; i < n; ++i)
+	{
+		if (faces[i].empty())
+		{
+			std::cout << "No face found and no valid eye pos at " + raw[i].filename << ", skipped.\n";
+			continue;
+		}
+		avgWidth += faces[i].width;
+		avgHeight += faces[i].height;
+		raw[kept] = raw[i];
+		data[kept] = data[i];
+		faces[kept] = faces[i];
+		kept++;
+	}
+	raw.resize(kept);
+	data.resize(kept);
+	faces.resize(kept);
+
+	if (canonicalSize.area() > 0 || kept == 0)
+		return;
+
+	// it seems that the detected faces are always N * N, thus one variable should be enough
+	cv::Size avgSize(avgWidth / kept, avgHeight / kept);
+
+	cv::parallel_for_(cv::Range(0, kept), [&](const cv::Range& range)
+		{
+			for (int i = range.start; i < range.end; ++i)
+				normalize(i, avgSize);
+		});
+}
+
+// pixels handled by one task of calAvgAndDiffMat, the sums and one block of every image should stay in cache
+constexpr int PixelBlock = 4096;
+
+// sum[j] += p[j], j < len
+void accumulatePixels(const uchar* p, unsigned* sum, int len)
+{
+	int j = 0;
+#if CV_SIMD
+	const int lanes = cv::v_uint8::nlanes;
+	const int quarter = cv::v_uint32::nlanes;
+	for (; j <= len - lanes; j += lanes)
+	{
+		cv::v_uint16 lo, hi;
+		cv::v_expand(cv::vx_load(p + j), lo, hi);
+		cv::v_uint32 s0, s1, s2, s3;
+		cv::v_expand(lo, s0, s1);
+		cv::v_expand(hi, s2, s3);
+		cv::v_store(sum + j, cv::vx_load(sum + j) + s0);
+		cv::v_store(sum + j + quarter, cv::vx_load(sum + j + quarter) + s1);
+		cv::v_store(sum + j + quarter * 2, cv::vx_load(sum + j + quarter * 2) + s2);
+		cv::v_store(sum + j + quarter * 3, cv::vx_load(sum + j + quarter * 3) + s3);
+	}
+#endif
+	for (; j < len; ++j)
+		sum[j] += p[j];
+}
+
+// dst[j] = p[j] - mean[j], j < len
+void subtractPixels(const uchar* p, const float* mean, float* dst, int len)
+{
+	int j = 0;
+#if CV_SIMD
+	const int lanes = cv::v_uint8::nlanes;
+	const int quarter = cv::v_float32::nlanes;
+	for (; j <= len - lanes; j += lanes)
+	{
+		cv::v_uint16 lo, hi;
+		cv::v_expand(cv::vx_load(p + j), lo, hi);
+		cv::v_uint32 s[4];
+		cv::v_expand(lo, s[0], s[1]);
+		cv::v_expand(hi, s[2], s[3]);
+		for (int t = 0; t < 4; ++t)
+		{
+			int offset = j + quarter * t;
+			cv::v_float32 pixel = cv::v_cvt_f32(cv::v_reinterpret_as_s32(s[t]));
+			cv::v_store(dst + offset, pixel - cv::vx_load(mean + offset));
+		}
+	}
+#endif
+	for (; j < len; ++j)
+		dst[j] = static_cast<float>(p[j]) - mean[j];
+}
+
+void TrainDataSet::calAvgAndDiffMat(cv::Mat& avg, cv::Mat& diff) const
+{
+	int rows = data.at(0).image.rows;
+	int cols = data.at(0).image.cols;
+	int matSize = rows * cols;
+	int n = data.size();
+
+	// diffMat is [0,255] - [0,255] = [-255,255], and only float number supports vector multiply
+	avg.create(rows, cols, CV_8UC1);
+	diff.create(n, matSize, CV_32FC1);
+
+	// the resized images are continuous, so every image can be read as one long line
+	std::vector<const uchar*> pixels(n);
+	for (int i = 0; i < n; ++i)
+	{
+		CV_Assert(data[i].image.isContinuous() && data[i].image.size() == avg.size());
+		pixels[i] = data[i].image.ptr<uchar>();
+	}
+	uchar* pAvg = avg.ptr<uchar>();
+
+	int blocks = (matSize + PixelBlock - 1) / PixelBlock;
+	cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range& range)
+		{
+			// unsigned int should be enough? 32bit / 8bit = 2 ^ 24 possible image pixel sum upper bound
+			std::vector<unsigned> sum(PixelBlock);
+			std::vector<float> mean(PixelBlock);
+
+			for (int b = range.start; b < range.end; ++b)
+			{
+				int begin = b * PixelBlock;
+				int len = std::min(PixelBlock, matSize - begin);
+
+				std::fill(sum.begin(), sum.begin() + len, 0u);
+				for (int i = 0; i < n; ++i)
+					accumulatePixels(pixels[i] + begin, sum.data(), len);
+
+				for (int j = 0; j < len; ++j)
+				{
+					pAvg[begin + j] = static_cast<uchar>(sum[j] / n);
+					mean[j] = pAvg[begin + j];
+				}
+
+				// the block of every image is still in cache, write every row sequentially
+				for (int i = 0; i < n; ++i)
+					subtractPixels(pixels[i] + begin, mean.data(), diff.ptr<float>(i) + begin, len);
+			}
+		});
+}
+
+cv::Mat TrainDataSet::calCovMat() const
+{
+	int m = data.size();
+	// every pixel is the sum of m * diffMat.size * pixel * pixel.
+	// reverse the order to decrease complexity, diffMat holds one image per row, thus it is diffMat * diffMat'
+	cv::Mat covMat;
+	cv::mulTransposed(diffMat, covMat, false, cv::noArray(), 1.0 / m);
+
+	return covMat;
+}
+
+cv::Mat TrainDataSet::calEigenVector() const
+{
+	cv::Mat eigenValue;
+	cv::Mat reversedVector;
+	cv::eigen(covMat, eigenValue, reversedVector);
+
+	// turn the eigenVector of reversed covMat to that of the true covMat
+	// cv::eigen stores the eigen vectors as rows, and diffMat holds one image per row
+	cv::Mat eigenVector;
+	cv::gemm(diffMat, reversedVector, 1, cv::noArray(), 0, eigenVector, cv::GEMM_1_T | cv::GEMM_2_T);
+
+	return eigenVector;
+}
+
+std::vector<cv::Mat> TrainDataSet::outputEigenFace(int num) const
+{
+	// the quantized basis is widened into a copy, the model is never written
+	cv::Mat basis = precision == Precision::FP32 ? tEigenVector : quantizedBasis.dequantize();
+	num = std::max(0, std::min(num, basis.rows));
+
+	// map the float value to unsigned char
+	std::vector<cv::Mat> m(num);
+
+	// global normalize can decrease the noise, but will also make the image pale.
+	cv::parallel_for_(cv::Range(0, num), [&](const cv::Range& range)
+		{
+			for (int i = range.start; i < range.end; ++i)
+			{
+				// the i-th eigen face, local normalize by one vectorized min-max scaling into a new image
+				cv::Mat vec = basis.row(i);
+				double minVal, maxVal;
+				cv::minMaxLoc(vec, &minVal, &maxVal);
+				double scale = maxVal > minVal ? 255.0 / (maxVal - minVal) : 0;
+				vec.reshape(1, avgMat.rows).convertTo(m[i], CV_8U, scale, -minVal * scale);
+			}
+		});
+
+	return m;
+}
+
+bool TrainDataSet::exportEigenFaces(const std::string& path, int num, int cols) const
+{
+	std::vector<cv::Mat> faces = outputEigenFace(num);
+	if (faces.empty())
+	{
+		std::cout << "No eigen face to export.\n";
+		return false;
+	}
+
+	cols = std::max(1, std::min(cols, static_cast<int>(faces.size())));
+	int rows = (static_cast<int>(faces.size()) + cols - 1) / cols;
+	cv::Mat montage(rows * avgMat.rows, cols * avgMat.cols, CV_8UC1, cv::Scalar(0));
+	for (int i = 0; i < faces.size(); ++i)
+		faces[i].copyTo(montage(cv::Rect((i % cols) * avgMat.cols, (i / cols) * avgMat.rows, avgMat.cols, avgMat.rows)));
+
+	if (!cv::imwrite(path, montage))
+	{
+		std::cout << "Cannot write " + path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// training images projected by one task of getTrainingValue, the eigen basis is read once per block
+constexpr int ProjectBlock = 64;
+
+void TrainDataSet::getTrainingValue()
+{
+	// normalize the vector before calculating weight, the squared norms of all rows come from one vectorized pass
+	cv::Mat eigenNorm = NearestSearch::calRowSqrNorm(tEigenVector);
+	cv::parallel_for_(cv::Range(0, tEigenVector.rows), [&](const cv::Range& range)
+		{
+			for (int i = range.start; i < range.end; ++i)
+			{
+				float norm = std::sqrt(eigenNorm.at<float>(i));
+				cv::Mat vec = tEigenVector.row(i);
+				if (norm > 0)
+					vec.convertTo(vec, -1, 1.0 / norm);
+			}
+		});
+
+	// image_num * eigen_num = diffMat * tEigenVector', one multiplication per block of rows written in place
+	trainingValue.create(diffMat.rows, tEigenVector.rows, CV_32FC1);
+	int blockNum = (diffMat.rows + ProjectBlock - 1) / ProjectBlock;
+	cv::parallel_for_(cv::Range(0, blockNum), [&](const cv::Range& range)
+		{
+			for (int b = range.start; b < range.end; ++b)
+			{
+				cv::Range rows(b * ProjectBlock, std::min((b + 1) * ProjectBlock, diffMat.rows));
+				cv::Mat weight = trainingValue.rowRange(rows);
+				cv::gemm(diffMat.rowRange(rows), tEigenVector, 1, cv::noArray(), 0, weight, cv::GEMM_2_T);
+			}
+		});
+	trainingNorm = NearestSearch::calRowSqrNorm(trainingValue);
+}
+
+
+void TrainDataSet::train(bool useCasClassifier)
+{
+	unmapModel();
+	data.clear();
+	trainingValue.release();
+	quantizedBasis.release();
+
+	// seconds since the previous call
+	int64 tick = cv::getTickCount();
+	auto lap = [&tick]() {
+		int64 now = cv::getTickCount();
+		double sec = static_cast<double>(now - tick) / cv::getTickFrequency();
+		tick = now;
+		return sec;
+	};
+
+	preprocess(useCasClassifier);
+	timings.preprocess = lap();
+	calAvgAndDiffMat(avgMat, diffMat);
+	timings.avgAndDiff = lap();
+	covMat = calCovMat();
+	timings.covMat = lap();
+	eigenVector = calEigenVector();
+	cv::transpose(eigenVector, tEigenVector);
+	timings.eigenVector = lap();
+	getTrainingValue();
+	timings.trainingValue = lap();
+	buildIndex();
+	timings.index = lap();
+	applyPrecision();
+	timings.precision = lap();
+}
+
+// raw images decoded at once by the preprocessing passes of trainOutOfCore
+constexpr int StreamChunk = 64;
+// extra directions of the randomized subspace iteration, and the number of power iterations
+constexpr int Oversample = 10;
+constexpr int PowerIterations = 2;
+
+// orthonormalize the cols of mat through the eigen decomposition of mat' * mat, the same trick as calEigenVector
+void orthonormalizeCols(cv::Mat& mat)
+{
+	// the gram mat squares the condition number, a second pass recovers the lost precision
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		cv::Mat gram, value, vector;
+		cv::mulTransposed(mat, gram, true, cv::noArray(), 1, CV_64F);
+		cv::eigen(gram, value, vector);
+
+		cv::Mat scale(mat.cols, mat.cols, CV_64FC1, cv::Scalar(0));
+		for (int i = 0; i < mat.cols; ++i)
+		{
+			double v = value.at<double>(i);
+			if (v > value.at<double>(0) * 1e-12)
+				scale.at<double>(i, i) = 1 / std::sqrt(v);
+		}
+		cv::Mat transform;
+		cv::Mat(vector.t() * scale).convertTo(transform, CV_32F);
+		mat = mat * transform;
+	}
+}
+
+void TrainDataSet::trainOutOfCore(const std::string& dir, int max, int components, const std::string& scratchPath, size_t memoryBudget)
+{
+	setScratchPath(scratchPath, memoryBudget);
+	trainFromFiles(ImageReader::listDataSet(dir, max), components, scratchPath, memoryBudget, true);
+}
+
+void TrainDataSet::trainFromFiles(const std::vector<std::string>& names, int components, const std::string& scratchFile, size_t memoryBudget, bool useCasClassifier)
+{
+	unmapModel();
+	data.clear();
+	diffMat.release();
+	covMat.release();
+	trainingValue.release();
+	raw.clear();
+
+	if (useCasClassifier && faceDetector->empty())
+	{
+		std::cout << "Face cascade classifier not found. Will use eye-face template instead.\n";
+		useCasClassifier = false;
+	}
+
+	// the face of every file, located by the first pass only, later passes just decode
+	std::vector<cv::Rect> located(names.size());
+	bool locatedAll = false;
+
+	// decode a chunk of raw images in parallel and apply func to every sample with its face
+	auto forEachChunk = [&](const std::function<void(std::vector<DataObject>&, std::vector<cv::Rect>&)>& func)
+	{
+		for (int begin = 0; begin < names.size(); begin += StreamChunk)
+		{
+			int end = std::min(begin + StreamChunk, static_cast<int>(names.size()));
+			std::vector<DataObject> chunk(end - begin);
+			cv::parallel_for_(cv::Range(begin, end), [&](const cv::Range& range)
+				{
+					for (int i = range.start; i < range.end; ++i)
+					{
+						// a file without a face is not decoded again
+						if (locatedAll && located[i].empty())
+						{
+							chunk[i - begin].filename = names[i];
+							continue;
+						}
+						chunk[i - begin] = ImageReader::loadFile(names[i]);
+						if (!locatedAll && !chunk[i - begin].image.empty())
+							located[i] = locateFace(*faceDetector, chunk[i - begin], useCasClassifier);
+					}
+				}, end - begin);
+			std::vector<cv::Rect> faces(located.begin() + begin, located.begin() + end);
+			func(chunk, faces);
+		}
+		locatedAll = true;
+	};
+
+	// the face size has to be known before any face can be spilled, so detect first unless it is fixed
+	cv::Size faceSize = canonicalSize;
+	if (faceSize.area() <= 0)
+	{
+		long long avgWidth = 0, avgHeight = 0, count = 0;
+		forEachChunk([&](std::vector<DataObject>& chunk, std::vector<cv::Rect>& faces)
+			{
+				for (auto& face : faces)
+				{
+					if (face.empty())
+						continue;
+					avgWidth += face.width;
+					avgHeight += face.height;
+					count++;
+				}
+			});
+		if (count == 0)
+		{
+			std::cout << "Cannot find any face in the data set.\n";
+			return;
+		}
+		faceSize = cv::Size(static_cast<int>(avgWidth / count), static_cast<int>(avgHeight / count));
+	}
+
+	int matSize = faceSize.area();
+
+	// spill the preprocessed faces and sum up every pixel
+	std::fstream scratch(scratchFile, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!scratch.is_open())
+	{
+		std::cout << "Cannot open scratch file " + scratchFile << std::endl;
+		return;
+	}
+	std::vector<unsigned long long> pixelSum(matSize, 0);
+	std::vector<unsigned> chunkSum(matSize);
+	forEachChunk([&](std::vector<DataObject>& chunk, std::vector<cv::Rect>& faces)
+		{
+			std::vector<cv::Mat> normalized(chunk.size());
+			cv::parallel_for_(cv::Range(0, static_cast<int>(chunk.size())), [&](const cv::Range& range)
+				{
+					for (int i = range.start; i < range.end; ++i)
+						if (!faces[i].empty())
+							normalized[i] = normalizeFace(chunk[i], faces[i], faceSize);
+				});
+
+			std::fill(chunkSum.begin(), chunkSum.end(), 0u);
+			for (int i = 0; i < chunk.size(); ++i)
+			{
+				if (normalized[i].empty())
+				{
+					std::cout << "No face found at " + chunk[i].filename << ", skipped.\n";
+					continue;
+				}
+				scratch.write(reinterpret_cast<const char*>(normalized[i].ptr<uchar>()), matSize);
+				accumulatePixels(normalized[i].ptr<uchar>(), chunkSum.data(), matSize);
+
+				// keep everything but the image
+				DataObject obj = chunk[i];
+				obj.image.release();
+				raw.push_back(obj);
+			}
+			for (int j = 0; j < matSize; ++j)
+				pixelSum[j] += chunkSum[j];
+		});
+	scratch.close();
+
+	int n = raw.size();
+	if (n == 0)
+	{
+		std::remove(scratchFile.c_str());
+		return;
+	}
+
+	avgMat.create(faceSize, CV_8UC1);
+	std::vector<float> mean(matSize);
+	for (int j = 0; j < matSize; ++j)
+	{
+		avgMat.data[j] = static_cast<uchar>(pixelSum[j] / n);
+		mean[j] = avgMat.data[j];
+	}
+
+	// rows of the scratch file streamed at once, a block is held as bytes and as floats
+	int blockRows = static_cast<int>(std::max<size_t>(1, memoryBudget / (static_cast<size_t>(matSize) * (1 + sizeof(float)))));
+	blockRows = std::min(blockRows, n);
+	std::vector<uchar> buffer(static_cast<size_t>(blockRows) * matSize);
+	cv::Mat block(blockRows, matSize, CV_32FC1);
+
+	// stream the centred faces, func gets the block and the index of its first row
+	auto forEachBlock = [&](const std::function<void(const cv::Mat&, int)>& func)
+	{
+		std::fstream in(scratchFile, std::ios::in | std::ios::binary);
+		for (int begin = 0; begin < n; begin += blockRows)
+		{
+			int rows = std::min(blockRows, n - begin);
+			in.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(rows) * matSize);
+			cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range& range)
+				{
+					for (int i = range.start; i < range.end; ++i)
+						subtractPixels(buffer.data() + static_cast<size_t>(i) * matSize, mean.data(), block.ptr<float>(i), matSize);
+				});
+			func(block.rowRange(0, rows), begin);
+		}
+	};
+
+	// randomized subspace iteration on the scatter mat C = D' * D, which is never formed
+	int k = std::min(components, n);
+	int l = std::min(k + Oversample, n);
+
+	cv::Mat basis(matSize, l, CV_32FC1);
+	cv::RNG rng(0x5eed);
+	rng.fill(basis, cv::RNG::NORMAL, 0, 1);
+
+	for (int iter = 0; iter <= PowerIterations; ++iter)
+	{
+		// basis = C * basis
+		cv::Mat next(matSize, l, CV_32FC1, cv::Scalar(0));
+		forEachBlock([&](const cv::Mat& d, int)
+			{
+				cv::Mat z = d * basis;
+				cv::Mat part;
+				cv::gemm(d, z, 1, cv::noArray(), 0, part, cv::GEMM_1_T);
+				next += part;
+			});
+		basis = next;
+		orthonormalizeCols(basis);
+	}
+
+	// project C onto the basis, Q' * C * Q = Z' * Z with Z = D * Q, keep Z for the training weights
+	cv::Mat z(n, l, CV_32FC1);
+	forEachBlock([&](const cv::Mat& d, int first)
+		{
+			cv::Mat part = d * basis;
+			part.copyTo(z.rowRange(first, first + d.rows));
+		});
+	cv::Mat small, smallValue, smallVector;
+	cv::mulTransposed(z, small, true);
+	cv::eigen(small, smallValue, smallVector);
+
+	// eigen faces are Q * v, the weights of the training images are Z * v
+	cv::Mat rotation = smallVector.rowRange(0, k);
+	tEigenVector = rotation * basis.t();
+	cv::transpose(tEigenVector, eigenVector);
+	trainingValue = z * rotation.t();
+	trainingNorm = NearestSearch::calRowSqrNorm(trainingValue);
+	buildIndex();
+	quantizedBasis.release();
+	applyPrecision();
+
+	std::remove(scratchFile.c_str());
+	std::cout << "Trained " << n << " images out of core, " << k << " components.\n";
+}
+
+void TrainDataSet::setPrecision(Precision p)
+{
+	precision = p;
+	applyPrecision();
+}
+
+void TrainDataSet::applyPrecision()
+{
+	if (precision == Precision::FP32)
+	{
+		if (!quantizedBasis.empty())
+		{
+			tEigenVector = quantizedBasis.dequantize();
+			cv::transpose(tEigenVector, eigenVector);
+			quantizedBasis.release();
+		}
+		return;
+	}
+
+	if (tEigenVector.empty())
+	{
+		if (quantizedBasis.empty() || quantizedBasis.getPrecision() == precision)
+			return;
+		tEigenVector = quantizedBasis.dequantize();
+	}
+	quantizedBasis.quantize(tEigenVector, precision);
+	// the float basis is what takes the memory
+	tEigenVector.release();
+	eigenVector.release();
+}
+
+cv::Mat TrainDataSet::project(const cv::Mat& diff) const
+{
+	if (precision == Precision::FP32)
+		return tEigenVector * diff;
+	return quantizedBasis.project(diff.t());
+}
+
+void TrainDataSet::useIndex(int listNum)
+{
+	indexListNum = listNum;
+	if (indexListNum < 0)
+		index.clear();
+	else if (!trainingValue.empty())
+		buildIndex();
+}
+
+void TrainDataSet::buildIndex()
+{
+	resolveIdentities();
+	buildTemplates();
+	if (indexListNum < 0)
+		return;
+	index.build(trainingValue, indexListNum);
+}
+
+void TrainDataSet::useTemplates(int rerank)
+{
+	templateRerank = rerank;
+	resolveIdentities();
+	buildTemplates();
+}
+
+void TrainDataSet::setIdentityManifest(const std::string& path)
+{
+	identityManifest = ImageReader::loadIdentityManifest(path);
+}
+
+void TrainDataSet::resolveIdentities()
+{
+	for (auto& obj : raw)
+	{
+		if (!identityManifest.empty())
+		{
+			std::string name = obj.filename.substr(obj.filename.find_last_of("\\/") + 1);
+			auto it = identityManifest.find(name);
+			if (it != identityManifest.end())
+			{
+				obj.identity = it->second;
+				continue;
+			}
+		}
+		if (obj.identity.empty())
+			obj.identity = ImageReader::parseIdentity(obj.filename);
+	}
+}
+
+void TrainDataSet::buildTemplates()
+{
+	templateValue.release();
+	templateNorm.release();
+	templateImage.clear();
+	templateOffsets.clear();
+	templateMembers.clear();
+	if (templateRerank < 0 || trainingValue.empty())
+		return;
+
+	// identities numbered in the order they first appear
+	int n = trainingValue.rows;
+	std::map<std::string, int> identities;
+	std::vector<int> label(n);
+	for (int i = 0; i < n; ++i)
+		label[i] = identities.emplace(raw.at(i).identity, static_cast<int>(identities.size())).first->second;
+	int t = identities.size();
+	if (t == 1 && n > 1)
+		std::cout << "All training images have the same identity, label them by file name or by a manifest.\n";
+
+	// group the images by identity, the same counting sort as the lists of the index
+	templateOffsets.assign(t + 1, 0);
+	for (int i = 0; i < n; ++i)
+		templateOffsets[label[i] + 1]++;
+	for (int c = 0; c < t; ++c)
+		templateOffsets[c + 1] += templateOffsets[c];
+	templateMembers.resize(n);
+	std::vector<int> next(templateOffsets.begin(), templateOffsets.end() - 1);
+	for (int i = 0; i < n; ++i)
+		templateMembers[next[label[i]]++] = i;
+
+	templateValue.create(t, trainingValue.cols, CV_32FC1);
+	templateImage.resize(t);
+	cv::parallel_for_(cv::Range(0, t), [&](const cv::Range& range)
+		{
+			for (int c = range.start; c < range.end; ++c)
+			{
+				cv::Mat mean = templateValue.row(c);
+				mean.setTo(0);
+				for (int j = templateOffsets[c]; j < templateOffsets[c + 1]; ++j)
+					cv::add(mean, trainingValue.row(templateMembers[j]), mean);
+				mean.convertTo(mean, -1, 1.0 / (templateOffsets[c + 1] - templateOffsets[c]));
+
+				// the medoid stands for the identity in the matches
+				double best = DBL_MAX;
+				for (int j = templateOffsets[c]; j < templateOffsets[c + 1]; ++j)
+				{
+					double dist = cv::norm(trainingValue.row(templateMembers[j]), mean, cv::NORM_L2SQR);
+					if (dist < best)
+					{
+						best = dist;
+						templateImage[c] = templateMembers[j];
+					}
+				}
+			}
+		});
+	templateNorm = NearestSearch::calRowSqrNorm(templateValue);
+}
+
+std::vector<Match> TrainDataSet::findNearestTemplate(const cv::Mat& weight, int k) const
+{
+	if (templateRerank == 0)
+	{
+		auto matches = NearestSearch::findNearest(templateValue, templateNorm, weight, k);
+		for (auto& m : matches)
+			m.index = templateImage[m.index];
+		return matches;
+	}
+
+	// rescore every image of the nearest identities
+	std::vector<int> candidates;
+	for (auto& m : NearestSearch::findNearest(templateValue, templateNorm, weight, templateRerank))
+		candidates.insert(candidates.end(), templateMembers.begin() + templateOffsets[m.index], templateMembers.begin() + templateOffsets[m.index + 1]);
+
+	cv::Mat gallery(static_cast<int>(candidates.size()), trainingValue.cols, CV_32FC1);
+	cv::Mat galleryNorm(static_cast<int>(candidates.size()), 1, CV_32FC1);
+	for (int j = 0; j < candidates.size(); ++j)
+	{
+		trainingValue.row(candidates[j]).copyTo(gallery.row(j));
+		galleryNorm.at<float>(j) = trainingNorm.at<float>(candidates[j]);
+	}
+	auto matches = NearestSearch::findNearest(gallery, galleryNorm, weight, k);
+	for (auto& m : matches)
+		m.index = candidates[m.index];
+	return matches;
+}
+
+std::vector<Match> TrainDataSet::findNearest(const cv::Mat& weight, int k) const
+{
+	if (templateRerank >= 0 && !templateValue.empty())
+		return findNearestTemplate(weight, k);
+	if (probeNum > 0 && !index.empty())
+		return index.search(weight, k, probeNum);
+	return NearestSearch::findNearest(trainingValue, trainingNorm, weight, k);
+}
+
+void TrainDataSet::update(const std::vector<DataObject>& samples, double maxDrift, bool useCasClassifier)
+{
+	if (samples.empty())
+		return;
+	if (mapping)
+	{
+		std::cout << "A mapped model is read-only, load model.xml to update it.\n";
+		return;
+	}
+
+	// the update works on the float basis
+	if (precision != Precision::FP32)
+	{
+		Precision stored = precision;
+		setPrecision(Precision::FP32);
+		update(samples, maxDrift, useCasClassifier);
+		setPrecision(stored);
+		return;
+	}
+
+	// no model to fold the samples into
+	if (tEigenVector.empty() || trainingValue.empty())
+	{
+		raw.insert(raw.end(), samples.begin(), samples.end());
+		train(useCasClassifier);
+		return;
+	}
+
+	useCasClassifier = useCasClassifier && !faceDetector->empty();
+
+	cv::Size faceSize(avgMat.cols, avgMat.rows);
+	int matSize = avgMat.rows * avgMat.cols;
+
+	// the new samples as columns, the same layout as the eigen vectors
+	std::vector<DataObject> accepted;
+	std::vector<cv::Mat> faces;
+	for (auto& obj : samples)
+	{
+		cv::Mat face = extractFace(*faceDetector, obj, useCasClassifier, faceSize);
+		if (face.empty())
+		{
+			std::cout << "No face found and no valid eye pos at " + obj.filename << ", skipped.\n";
+			continue;
+		}
+		accepted.push_back(obj);
+		faces.push_back(face);
+	}
+	if (accepted.empty())
+		return;
+
+	int n = trainingValue.rows;
+	int m = accepted.size();
+
+	cv::Mat newData(matSize, m, CV_32FC1);
+	for (int i = 0; i < m; ++i)
+		faces[i].reshape(1, matSize).convertTo(newData.col(i), CV_32F);
+
+	// update the mean, the model keeps the average image in 8 bits, so continue with the rounded one
+	cv::Mat oldMean, newMean, mean;
+	avgMat.reshape(1, matSize).convertTo(oldMean, CV_32F);
+	cv::reduce(newData, newMean, 1, cv::REDUCE_AVG);
+	cv::Mat newAvgMat;
+	cv::Mat((oldMean * n + newMean * m) / (n + m)).reshape(1, avgMat.rows).convertTo(newAvgMat, CV_8U);
+	newAvgMat.reshape(1, matSize).convertTo(mean, CV_32F);
+	cv::Mat shift = oldMean - mean;
+
+	// the scatter around the new mean is U * S^2 * U' + E * E', where E holds the mean shift of the old samples and the new samples
+	cv::Mat extra(matSize, m + 1, CV_32FC1);
+	cv::Mat(shift * std::sqrt(static_cast<double>(n))).copyTo(extra.col(0));
+	for (int i = 0; i < m; ++i)
+		cv::subtract(newData.col(i), mean, extra.col(i + 1));
+
+	// the energy of every component of the old basis can be recovered from the training weights
+	cv::Mat sigma;
+	cv::reduce(trainingValue.mul(trainingValue), sigma, 0, cv::REDUCE_SUM);
+	cv::sqrt(sigma, sigma);
+
+	// drop the degenerated components, they are not orthogonal to the others
+	double maxSigma;
+	cv::minMaxLoc(sigma, nullptr, &maxSigma);
+	std::vector<int> kept;
+	for (int i = 0; i < sigma.cols; ++i)
+		if (sigma.at<float>(i) > maxSigma * 1e-5)
+			kept.push_back(i);
+	int k = kept.size();
+
+	cv::Mat basis(k, matSize, CV_32FC1);
+	cv::Mat oldWeight(k, n, CV_32FC1);
+	for (int i = 0; i < k; ++i)
+	{
+		tEigenVector.row(kept[i]).copyTo(basis.row(i));
+		cv::transpose(trainingValue.col(kept[i]), oldWeight.row(i));
+	}
+
+	// split E into the part inside the current basis and the residual
+	cv::Mat proj = basis * extra;
+	cv::Mat residual;
+	cv::gemm(basis, proj, -1, extra, 1, residual, cv::GEMM_1_T);
+
+	double totalEnergy = cv::norm(extra);
+	double drift = totalEnergy > 0 ? std::pow(cv::norm(residual) / totalEnergy, 2) : 0;
+	if (drift > maxDrift)
+	{
+		std::cout << "Residual energy ratio " << drift << " exceeds " << maxDrift << ", retraining the whole model.\n";
+		// a model trained out of core keeps only the file names in raw, train would find no face in them
+		if (std::any_of(raw.begin(), raw.end(), [](const DataObject& obj) { return obj.image.empty(); }))
+		{
+			if (scratchPath.empty())
+			{
+				std::cout << "The model was trained out of core and no scratch path is set, the new samples are not added.\n";
+				return;
+			}
+			std::vector<std::string> names;
+			for (auto& obj : raw)
+				names.push_back(obj.filename);
+			for (auto& obj : accepted)
+				names.push_back(obj.filename);
+			trainFromFiles(names, tEigenVector.rows, scratchPath, scratchBudget, useCasClassifier);
+			return;
+		}
+		raw.insert(raw.end(), accepted.begin(), accepted.end());
+		train(useCasClassifier);
+		return;
+	}
+
+	// orthonormal basis of the residual, with the same reversed trick as calEigenVector
+	cv::Mat resValue, resVector;
+	cv::eigen(cv::Mat(residual.t() * residual), resValue, resVector);
+	int r = 0;
+	while (r < resValue.rows && resValue.at<float>(r) > resValue.at<float>(0) * 1e-6f && resValue.at<float>(r) > 0)
+		++r;
+	cv::Mat resBasis(r, matSize, CV_32FC1);
+	for (int i = 0; i < r; ++i)
+	{
+		cv::Mat vec = residual * resVector.row(i).t() / std::sqrt(resValue.at<float>(i));
+		cv::transpose(vec, resBasis.row(i));
+	}
+
+	// small (k + r) * (k + m + 1) problem: [diag(S) P; 0 Q'R]
+	cv::Mat small(k + r, k + m + 1, CV_32FC1, cv::Scalar(0));
+	for (int i = 0; i < k; ++i)
+		small.at<float>(i, i) = sigma.at<float>(kept[i]);
+	proj.copyTo(small(cv::Rect(k, 0, m + 1, k)));
+	if (r > 0)
+		cv::Mat(resBasis * residual).copyTo(small(cv::Rect(k, k, m + 1, r)));
+
+	cv::Mat w, u, vt;
+	cv::SVD::compute(small, w, u, vt);
+
+	// never keep more components than samples, like train does
+	int c = 0;
+	while (c < w.rows && c < n + m && w.at<float>(c) > w.at<float>(0) * 1e-5f)
+		++c;
+	cv::Mat rotation = u.colRange(0, c);
+
+	cv::Mat fullBasis;
+	if (r > 0)
+		cv::vconcat(basis, resBasis, fullBasis);
+	else
+		fullBasis = basis;
+
+	tEigenVector = rotation.t() * fullBasis;
+	cv::transpose(tEigenVector, eigenVector);
+
+	// rotate the old weights into the new basis and shift them to the new mean
+	cv::Mat oldFull(k + r, n, CV_32FC1, cv::Scalar(0));
+	oldWeight.copyTo(oldFull.rowRange(0, k));
+	cv::Mat shiftWeight = fullBasis * shift;
+	for (int j = 0; j < n; ++j)
+		cv::add(oldFull.col(j), shiftWeight, oldFull.col(j));
+	cv::Mat rotatedWeight = rotation.t() * oldFull;
+
+	cv::Mat newWeight = tEigenVector * extra.colRange(1, m + 1);
+
+	cv::Mat allWeight;
+	cv::hconcat(rotatedWeight, newWeight, allWeight);
+	cv::transpose(allWeight, trainingValue);
+	trainingNorm = NearestSearch::calRowSqrNorm(trainingValue);
+	raw.insert(raw.end(), accepted.begin(), accepted.end());
+	// the weights have all moved with the basis
+	buildIndex();
+
+	avgMat = newAvgMat;
+
+	// the intermediate results of the last full training no longer match the model
+	data.clear();
+	diffMat.release();
+	covMat.release();
+
+	std::cout << "Updated the model with " << m << " samples, residual energy ratio " << drift << ", " << c << " components.\n";
+}
+
+std::vector<RecognizeResult> TrainDataSet::recognizeBatch(const std::vector<DataObject>& objs, bool useCasClassifier, int k) const
+{
+	int n = objs.size();
+	std::vector<RecognizeResult> results(n);
+	if (n == 0)
+		return results;
+
+	cv::Size avgSize(avgMat.cols, avgMat.rows);
+	int matSize = avgMat.rows * avgMat.cols;
+	cv::Mat avg;
+	avgMat.reshape(1, matSize).convertTo(avg, CV_32F);
+
+	// one col per probe, so that all of them are projected by one multiplication
+	cv::Mat diff(matSize, n, CV_32FC1, cv::Scalar(0));
+
+	cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& range)
+		{
+			for (int i = range.start; i < range.end; ++i)
+			{
+				results[i].filename = objs[i].filename;
+
+				DataObject gray = objs[i];
+				if (gray.image.channels() == 3)
+					cv::cvtColor(objs[i].image, gray.image, cv::COLOR_BGR2GRAY);
+				else if (gray.image.channels() == 4)
+					cv::cvtColor(objs[i].image, gray.image, cv::COLOR_BGRA2GRAY);
+
+				cv::Mat face = gray.image.empty() ? cv::Mat() : extractFace(*faceDetector, gray, useCasClassifier, avgSize);
+				results[i].valid = !face.empty();
+				if (!results[i].valid)
+					continue;
+
+				cv::Mat faceVec;
+				face.reshape(1, matSize).convertTo(faceVec, CV_32F);
+				cv::subtract(faceVec, avg, diff.col(i));
+			}
+		});
+
+	matchProbes(diff, results, k);
+	return results;
+}
+
+std::vector<RecognizeResult> TrainDataSet::recognizeFaces(const std::vector<cv::Mat>& images, const std::vector<cv::Rect>& faces, int k) const
+{
+	CV_Assert(images.size() == faces.size());
+	int n = faces.size();
+	std::vector<RecognizeResult> results(n);
+	if (n == 0)
+		return results;
+
+	cv::Size avgSize(avgMat.cols, avgMat.rows);
+	int matSize = avgMat.rows * avgMat.cols;
+	cv::Mat avg;
+	avgMat.reshape(1, matSize).convertTo(avg, CV_32F);
+	cv::Mat diff(matSize, n, CV_32FC1, cv::Scalar(0));
+
+	cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& range)
+		{
+			for (int i = range.start; i < range.end; ++i)
+			{
+				cv::Rect rect = faces[i] & cv::Rect(0, 0, images[i].cols, images[i].rows);
+				results[i].valid = !rect.empty();
+				if (!results[i].valid)
+					continue;
+
+				// without eyes the rect is mapped onto the model size, the same transform as a detected face of recognizeBatch
+				DataObject obj{ InvalidEyePos, images[i], "" };
+				cv::Mat face = normalizeFace(obj, rect, avgSize);
+				cv::Mat faceVec;
+				face.reshape(1, matSize).convertTo(faceVec, CV_32F);
+				cv::subtract(faceVec, avg, diff.col(i));
+			}
+		});
+
+	matchProbes(diff, results, k);
+	return results;
+}
+
+void TrainDataSet::matchProbes(const cv::Mat& diff, std::vector<RecognizeResult>& results, int k) const
+{
+	// project all probes at once
+	cv::Mat weight = project(diff);
+
+	cv::parallel_for_(cv::Range(0, static_cast<int>(results.size())), [&](const cv::Range& range)
+		{
+			for (int i = range.start; i < range.end; ++i)
+			{
+				if (results[i].valid)
+					results[i].matches = findNearest(weight.col(i), k);
+			}
+		});
+}
+
+std::vector<Match> TrainDataSet::recognizeImage(const DataObject& obj, bool useCasClassifier, int k)
+{
+	RecognizeResult result = recognizeBatch({ obj }, useCasClassifier, k).at(0);
+	if (!result.valid)
+	{
+		std::cout << "No face detected and no valid eye pos at " + obj.filename << ", abort.\n";
+		return {};
+	}
+
+	std::vector<Match>& matches = result.matches;
+	int closestImage = matches.at(0).index;
+	double minDist = matches.at(0).dist;
+	std::cout << "The most similar image is " << raw[closestImage].filename << ", with dist = " << minDist << std::endl;
+	for (int i = 1; i < matches.size(); ++i)
+		std::cout << "Top " << i + 1 << ": " << raw[matches[i].index].filename << ", with dist = " << matches[i].dist << std::endl;
+	std::string shortName = raw[closestImage].filename.substr(raw[closestImage].filename.find_last_of("\\/") + 1);
+	cv::putText(obj.image, "Similar:" + shortName, { 0,30 }, cv::FONT_HERSHEY_SIMPLEX, 0.5, { 50,50,255 });
+	cv::putText(obj.image, "Dist=" + std::to_string(minDist), { 0,60 }, cv::FONT_HERSHEY_SIMPLEX, 0.5, { 50,50,255 });
+	//
+	cv::imshow("Source", obj.image);
+	// models trained out of core keep no source image
+	if (raw[closestImage].image.empty())
+		cv::imshow("Similar", cv::imread(raw[closestImage].filename + ".pgm", cv::IMREAD_GRAYSCALE));
+	else
+		cv::imshow("Similar", raw[closestImage].image);
+	cv::waitKey();
+
+	return matches;
+}
+
+void TrainDataSet::loadModel(const std::string& path)
+{
+	unmapModel();
+	cv::FileStorage fs;
+	fs.open(path + "model.xml", cv::FileStorage::Mode::READ);
+	if (!fs.isOpened())
+	{
+		std::cout << "Open model failed.\n";
+		return;
+	}
+	int srcNum;
+	fs["srcNum"] >> srcNum;
+	fs["AvgMat"] >> avgMat;
+	fs["TransEigenVector"] >> tEigenVector;
+	quantizedBasis.read(fs);
+	precision = quantizedBasis.getPrecision();
+	fs["TrainingValue"] >> trainingValue;
+	// models saved before the weights were stored as one mat keep one col vector per image
+	if (trainingValue.empty())
+	{
+		trainingValue.create(srcNum, tEigenVector.rows, CV_32FC1);
+		for (int i = 0; i < srcNum; ++i)
+		{
+			cv::Mat tValue;
+			fs["Training" + std::to_string(i)] >> tValue;
+			cv::transpose(tValue, trainingValue.row(i));
+		}
+	}
+	trainingNorm = NearestSearch::calRowSqrNorm(trainingValue);
+	index.read(fs, trainingValue);
+	indexListNum = index.empty() ? -1 : index.listNum();
+	// models saved before the templates have no template node
+	cv::FileNode rerankNode = fs["TemplateRerank"];
+	templateRerank = rerankNode.empty() ? -1 : static_cast<int>(rerankNode);
+	fs["TemplateValue"] >> templateValue;
+	fs["TemplateImage"] >> templateImage;
+	fs["TemplateOffsets"] >> templateOffsets;
+	fs["TemplateMembers"] >> templateMembers;
+	templateNorm = templateValue.empty() ? cv::Mat() : NearestSearch::calRowSqrNorm(templateValue);
+	for (int i = 0; i < srcNum; ++i)
+	{
+		cv::Mat src;
+		std::string name;
+		fs["src" + std::to_string(i)] >> src;
+		fs["srcName" + std::to_string(i)] >> name;
+		DataObject obj;
+		obj.image = src;
+		obj.filename = name;
+		// models saved before the eye positions were stored have no eye node
+		cv::FileNode eyeNode = fs["srcEye" + std::to_string(i)];
+		if (eyeNode.empty())
+			obj.eye = InvalidEyePos;
+		else
+		{
+			cv::Vec4i eye;
+			eyeNode >> eye;
+			obj.eye = { eye[0], eye[1], eye[2], eye[3] };
+		}
+		fs["srcIdentity" + std::to_string(i)] >> obj.identity;
+		raw.push_back(obj);
+	}
+	fs.release();
+	resolveIdentities();
+}
+
+void TrainDataSet::saveModel(const std::string& path)
+{
+	cv::FileStorage fs;
+	fs.open(path + "model.xml", cv::FileStorage::Mode::WRITE);
+	if (!fs.isOpened())
+	{
+		std::cout << "Open model failed.\n";
+		return;
+	}
+	fs << "srcNum" << static_cast<int>(raw.size());
+	fs << "AvgMat" << avgMat;
+	fs << "EigenPrecision" << static_cast<int>(precision);
+	if (precision == Precision::FP32)
+		fs << "TransEigenVector" << tEigenVector;
+	else
+		quantizedBasis.write(fs);
+	fs << "TrainingValue" << trainingValue;
+	if (indexListNum >= 0 && index.empty())
+		buildIndex();
+	if (!index.empty())
+		index.write(fs);
+	fs << "TemplateRerank" << templateRerank;
+	if (!templateValue.empty())
+	{
+		fs << "TemplateValue" << templateValue;
+		fs << "TemplateImage" << templateImage;
+		fs << "TemplateOffsets" << templateOffsets;
+		fs << "TemplateMembers" << templateMembers;
+	}
+	for (int i = 0; i < raw.size(); ++i)
+	{
+		fs << "src" + std::to_string(i) << raw[i].image;
+		fs << "srcName" + std::to_string(i) << raw[i].filename;
+		// needed by the eye-face template when the model is retrained from raw
+		fs << "srcEye" + std::to_string(i) << cv::Vec4i(raw[i].eye.LeftX, raw[i].eye.LeftY, raw[i].eye.RightX, raw[i].eye.RightY);
+		fs << "srcIdentity" + std::to_string(i) << raw[i].identity;
+	}
+	fs.release();
+}
+
+// 64 byte aligned section layout of the mapped model, every section is a continuous mat or array
+struct MappedSection
+{
+	uint64_t* offset;
+	const void* data;
+	size_t bytes;
+};
+
+bool TrainDataSet::exportMappedModel(const std::string& path) const
+{
+	if (trainingValue.empty() || basisBytes() == 0)
+	{
+		std::cout << "No trained model to export.\n";
+		return false;
+	}
+
+	MappedModelHeader header = {};
+	std::copy(MappedModelMagic, MappedModelMagic + 4, header.magic);
+	header.version = MappedModelVersion;
+	header.rows = avgMat.rows;
+	header.cols = avgMat.cols;
+	header.eigenNum = trainingValue.cols;
+	header.imageNum = trainingValue.rows;
+	header.precision = static_cast<int32_t>(precision);
+	header.listNum = index.empty() ? 0 : index.listNum();
+	header.templateNum = templateRerank >= 0 ? templateValue.rows : 0;
+	header.templateRerank = templateRerank;
+
+	// keep continuous copies alive until everything is written
+	std::vector<cv::Mat> keep;
+	auto continuous = [&keep](const cv::Mat& m) -> const cv::Mat& {
+		keep.push_back(m.isContinuous() ? m : m.clone());
+		return keep.back();
+	};
+	keep.reserve(16);
+
+	std::vector<MappedSection> sections;
+	auto addMat = [&](uint64_t* offset, const cv::Mat& m) {
+		const cv::Mat& c = continuous(m);
+		sections.push_back({ offset, c.data, c.total() * c.elemSize() });
+	};
+
+	addMat(&header.avgOffset, avgMat);
+	if (precision == Precision::FP32)
+		addMat(&header.basisOffset, tEigenVector);
+	else
+	{
+		addMat(&header.basisOffset, quantizedBasis.getData());
+		if (!quantizedBasis.getScale().empty())
+			addMat(&header.scaleOffset, quantizedBasis.getScale());
+	}
+	addMat(&header.weightOffset, trainingValue);
+	addMat(&header.normOffset, trainingNorm);
+	if (!index.empty())
+	{
+		addMat(&header.centroidOffset, index.getCentroids());
+		sections.push_back({ &header.listOffset, index.getOffsets().data(), index.getOffsets().size() * sizeof(int32_t) });
+		sections.push_back({ &header.idOffset, index.getIds().data(), index.getIds().size() * sizeof(int32_t) });
+		addMat(&header.vectorOffset, index.getVectors());
+		addMat(&header.vectorNormOffset, index.getVectorNorm());
+	}
+
+	if (header.templateNum > 0)
+	{
+		addMat(&header.templateOffset, templateValue);
+		addMat(&header.templateNormOffset, templateNorm);
+		sections.push_back({ &header.templateImageOffset, templateImage.data(), templateImage.size() * sizeof(int32_t) });
+		sections.push_back({ &header.memberListOffset, templateOffsets.data(), templateOffsets.size() * sizeof(int32_t) });
+		sections.push_back({ &header.memberOffset, templateMembers.data(), templateMembers.size() * sizeof(int32_t) });
+	}
+
+	std::vector<uint64_t> nameOffsets(1, 0), identityOffsets(1, 0);
+	std::string chars, identityChars;
+	for (int i = 0; i < header.imageNum; ++i)
+	{
+		chars += raw.at(i).filename;
+		nameOffsets.push_back(chars.size());
+		identityChars += raw.at(i).identity;
+		identityOffsets.push_back(identityChars.size());
+	}
+	sections.push_back({ &header.nameOffset, nameOffsets.data(), nameOffsets.size() * sizeof(uint64_t) });
+	sections.push_back({ &header.charOffset, chars.data(), chars.size() });
+	sections.push_back({ &header.identityOffset, identityOffsets.data(), identityOffsets.size() * sizeof(uint64_t) });
+	sections.push_back({ &header.identityCharOffset, identityChars.data(), identityChars.size() });
+
+	auto align = [](uint64_t pos) { return (pos + MappedModelAlign - 1) / MappedModelAlign * MappedModelAlign; };
+	uint64_t pos = align(sizeof(header));
+	for (auto& section : sections)
+	{
+		*section.offset = pos;
+		pos = align(pos + section.bytes);
+	}
+	header.totalSize = pos;
+
+	std::fstream out(path, std::ios::out | std::ios::binary);
+	if (!out.is_open())
+	{
+		std::cout << "Open mapped model failed.\n";
+		return false;
+	}
+	const char zeros[MappedModelAlign] = {};
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	uint64_t written = sizeof(header);
+	for (auto& section : sections)
+	{
+		out.write(zeros, *section.offset - written);
+		out.write(static_cast<const char*>(section.data), section.bytes);
+		written = *section.offset + section.bytes;
+	}
+	out.write(zeros, header.totalSize - written);
+	out.close();
+	return !out.fail();
+}
+
+bool TrainDataSet::mapModel(const std::string& path)
+{
+	auto file = std::make_shared<MappedFile>();
+	if (!file->open(path))
+	{
+		std::cout << "Open mapped model failed.\n";
+		return false;
+	}
+	if (file->size() < sizeof(MappedModelHeader))
+	{
+		std::cout << "Mapped model is truncated.\n";
+		return false;
+	}
+	MappedModelHeader header;
+	std::copy(file->data(), file->data() + sizeof(header), reinterpret_cast<unsigned char*>(&header));
+	if (!std::equal(MappedModelMagic, MappedModelMagic + 4, header.magic) || header.version != MappedModelVersion)
+	{
+		std::cout << "Not a mapped model, or written by another version.\n";
+		return false;
+	}
+	if (header.totalSize > file->size())
+	{
+		std::cout << "Mapped model is truncated.\n";
+		return false;
+	}
+
+	unmapModel();
+	data.clear();
+	diffMat.release();
+	covMat.release();
+	eigenVector.release();
+
+	// the mats are read-only, cv::Mat has no const view so the constness is dropped here and kept by unmapModel
+	auto at = [&file](uint64_t offset) { return const_cast<unsigned char*>(file->data() + offset); };
+	int matSize = header.rows * header.cols;
+	int n = header.imageNum;
+	int k = header.eigenNum;
+
+	avgMat = cv::Mat(header.rows, header.cols, CV_8UC1, at(header.avgOffset));
+	precision = static_cast<Precision>(header.precision);
+	if (precision == Precision::FP32)
+	{
+		tEigenVector = cv::Mat(k, matSize, CV_32FC1, at(header.basisOffset));
+		quantizedBasis.release();
+	}
+	else
+	{
+		tEigenVector.release();
+		cv::Mat basis(k, matSize, precision == Precision::FP16 ? CV_16SC1 : CV_8SC1, at(header.basisOffset));
+		cv::Mat scale = header.scaleOffset ? cv::Mat(k, 1, CV_32FC1, at(header.scaleOffset)) : cv::Mat();
+		quantizedBasis.wrap(precision, basis, scale);
+	}
+	trainingValue = cv::Mat(n, k, CV_32FC1, at(header.weightOffset));
+	trainingNorm = cv::Mat(n, 1, CV_32FC1, at(header.normOffset));
+
+	if (header.listNum > 0)
+	{
+		auto offsets = reinterpret_cast<const int32_t*>(file->data() + header.listOffset);
+		auto ids = reinterpret_cast<const int32_t*>(file->data() + header.idOffset);
+		index.wrap(cv::Mat(header.listNum, k, CV_32FC1, at(header.centroidOffset)),
+			std::vector<int>(offsets, offsets + header.listNum + 1),
+			std::vector<int>(ids, ids + n),
+			cv::Mat(n, k, CV_32FC1, at(header.vectorOffset)),
+			cv::Mat(n, 1, CV_32FC1, at(header.vectorNormOffset)));
+		indexListNum = header.listNum;
+	}
+	else
+	{
+		index.clear();
+		indexListNum = -1;
+	}
+	if (header.templateNum > 0)
+	{
+		int t = header.templateNum;
+		templateValue = cv::Mat(t, k, CV_32FC1, at(header.templateOffset));
+		templateNorm = cv::Mat(t, 1, CV_32FC1, at(header.templateNormOffset));
+		auto images = reinterpret_cast<const int32_t*>(file->data() + header.templateImageOffset);
+		auto offsets = reinterpret_cast<const int32_t*>(file->data() + header.memberListOffset);
+		auto members = reinterpret_cast<const int32_t*>(file->data() + header.memberOffset);
+		templateImage.assign(images, images + t);
+		templateOffsets.assign(offsets, offsets + t + 1);
+		templateMembers.assign(members, members + n);
+		templateRerank = header.templateRerank;
+	}
+	else
+	{
+		templateRerank = -1;
+		buildTemplates();
+	}
+
+	auto nameOffsets = reinterpret_cast<const uint64_t*>(file->data() + header.nameOffset);
+	auto chars = reinterpret_cast<const char*>(file->data() + header.charOffset);
+	auto identityOffsets = reinterpret_cast<const uint64_t*>(file->data() + header.identityOffset);
+	auto identityChars = reinterpret_cast<const char*>(file->data() + header.identityCharOffset);
+	raw.assign(n, DataObject());
+	for (int i = 0; i < n; ++i)
+	{
+		raw[i].eye = InvalidEyePos;
+		raw[i].filename.assign(chars + nameOffsets[i], chars + nameOffsets[i + 1]);
+		raw[i].identity.assign(identityChars + identityOffsets[i], identityChars + identityOffsets[i + 1]);
+	}
+
+	mapping = file;
+	return true;
+}
+
+void TrainDataSet::unmapModel()
+{
+	if (!mapping)
+		return;
+	avgMat.release();
+	tEigenVector.release();
+	quantizedBasis.release();
+	trainingValue.release();
+	trainingNorm.release();
+	index.clear();
+	templateValue.release();
+	templateNorm.release();
+	raw.clear();
+	mapping.reset();
+}
@@ -0,0 +1,304 @@
+#pragma once
+#include <opencv2/imgproc.hpp>
+#include <vector>
+#include <memory>
+#include <map>
+#include "DataStruct.h"
+#include "IvfIndex.h"
+#include "FaceDetector.h"
+#include "QuantizedBasis.h"
+#include "MappedModel.h"
+
+
+// seconds spent in every stage of the last train, the mean and the difference are calculated in one pass
+struct TrainTimings
+{
+	double preprocess = 0;
+	double avgAndDiff = 0;
+	double covMat = 0;
+	double eigenVector = 0;
+	double trainingValue = 0;
+	double index = 0;
+	double precision = 0;
+};
+
+class TrainDataSet
+{
+	std::vector<DataObject> raw;
+	std::vector<DataObject> data;
+	cv::Mat avgMat;
+	// image_num * pixel_num, the difference of every image as one row
+	cv::Mat diffMat;
+	// image_num * image_num, this is not the true covMat, but a reversely multiplied one
+	cv::Mat covMat;
+	cv::Mat eigenVector;
+	cv::Mat tEigenVector;
+	// image_num * eigen_num, the weights of every training image as one row
+	cv::Mat trainingValue;
+	// image_num * 1, squared norm of every row of trainingValue
+	cv::Mat trainingNorm;
+	// approximate search over trainingValue
+	IvfIndex index;
+	// number of inverted lists of the index, 0 for sqrt(image_num), disabled when negative
+	int indexListNum = -1;
+	// number of lists scanned by a query, exact search when not positive
+	int probeNum = 8;
+	// identity_num * eigen_num, the class mean of the weights of every identity
+	cv::Mat templateValue;
+	// identity_num * 1, squared norm of every row of templateValue
+	cv::Mat templateNorm;
+	// the training image closest to every class mean, reported for a template match
+	std::vector<int> templateImage;
+	// identity i holds the images templateMembers[templateOffsets[i]] to templateMembers[templateOffsets[i + 1] - 1]
+	std::vector<int> templateOffsets;
+	std::vector<int> templateMembers;
+	// nearest identities whose images are searched one by one after the templates, templates are disabled when negative
+	int templateRerank = -1;
+	// identities of the training images by file name without directory, overriding the identities parsed from the file names
+	std::map<std::string, std::string> identityManifest;
+	// shared by preprocess and recognition, the cascade is only parsed once
+	cv::Ptr<FaceDetector> faceDetector = cv::makePtr<FaceDetector>();
+	// size of the preprocessed faces, the average size of the detected faces when empty
+	cv::Size canonicalSize;
+	// precision of the eigen basis, tEigenVector is released when it is not FP32
+	Precision precision = Precision::FP32;
+	QuantizedBasis quantizedBasis;
+	TrainTimings timings;
+	// the file the model mats point into after mapModel, empty otherwise
+	std::shared_ptr<MappedFile> mapping;
+	// where update spills the faces when it retrains a model trained out of core, and the memory it may use
+	std::string scratchPath;
+	size_t scratchBudget = 512 << 20;
+
+	/*
+	 * Preprocess the raw set, recognize faces and generate a new data set with the same size sub image.
+	 * Every sample is aligned by its eyes, or by the detected face when the eyes are unknown, resized and equalized in one warp in parallel.
+	 * Samples without a face are dropped from raw.
+	 */
+	void preprocess(bool useCasClassifier = true);
+
+	/*
+	 * Get the average image, every pixel of which is the average value of the corresponding pixels of all data set images,
+	 * and the difference of every image, every pixel of which subtracts the corresponding pixel of average image.
+	 * Both are calculated in one pass over blocks of pixels, so every image is streamed only once.
+	 * @param avg the average image, CV_8UC1
+	 * @param diff image_num * pixel_num, CV_32FC1
+	 */
+	void calAvgAndDiffMat(cv::Mat& avg, cv::Mat& diff) const;
+
+	/*
+	 * Calculate the covariant mat from member diffMat.
+	 */
+	cv::Mat calCovMat() const;
+
+	/*
+	 * Calculate the eigen vector from member covMat;
+	 */
+	cv::Mat calEigenVector() const;
+
+	/*
+	 * Normalize the eigen faces and project all of diffMat onto them.
+	 * The projection is one multiplication split into blocks of training images over all threads.
+	 */
+	void getTrainingValue();
+
+	// rebuild the index and the identity templates when they are enabled, trainingValue and raw should be up to date
+	void buildIndex();
+
+	// label every raw image by the manifest, or by its file name when it has no identity yet
+	void resolveIdentities();
+
+	// one class-mean template per identity of raw
+	void buildTemplates();
+
+	// search the k training images nearest to the weight, through the templates or the index when there is one
+	std::vector<Match> findNearest(const cv::Mat& weight, int k) const;
+
+	// search the templates first, then the images of the nearest identities when templateRerank is positive
+	std::vector<Match> findNearestTemplate(const cv::Mat& weight, int k) const;
+
+	// convert the eigen basis to the chosen precision
+	void applyPrecision();
+
+	// eigen_num * image_num weights of pixel_num * image_num centred images, in the precision of the basis
+	cv::Mat project(const cv::Mat& diff) const;
+
+	// project the pixel_num * probe_num centred probes and search the matches of the valid ones
+	void matchProbes(const cv::Mat& diff, std::vector<RecognizeResult>& results, int k) const;
+
+	// drop the mats pointing into the mapped model before anything writes into them
+	void unmapModel();
+
+	// trainOutOfCore over the given image files, file names without suffix
+	void trainFromFiles(const std::vector<std::string>& names, int components, const std::string& scratchFile, size_t memoryBudget, bool useCasClassifier);
+public:
+	/*
+	 * Load all images files in dir, save to raw set.
+	 * All source images should be gray scaled.
+	 * @param dir data set directory, end with \\
+	 * @param max the maximum size of the data set, or infinite when max is negative
+	 */
+	void loadDataSet(const std::string& dir, int max = -1);
+
+	// use samples already in memory as the raw set, in the format produced by ImageReader::loadDataSet
+	void setDataSet(const std::vector<DataObject>& samples) { raw = samples; }
+
+	/*
+	 * Train a new model from the raw set.
+	 * @param useCasClassifier locate the faces with the eye-face template only when false
+	 */
+	void train(bool useCasClassifier = true);
+
+	// time of every stage of the last train
+	const TrainTimings& getTimings() const { return timings; }
+
+	/*
+	 * Train from the images in dir without holding the data set in memory.
+	 * The preprocessed faces are spilled to a scratch file, then the eigen faces are found by a randomized subspace iteration
+	 * that streams the scratch file block by block, so the memory used is bounded by memoryBudget and pixel_num * components.
+	 * Only the file names and eye positions of the source images are kept in raw.
+	 * @param dir data set directory, end with \\
+	 * @param max the maximum size of the data set, or infinite when max is negative
+	 * @param components the number of eigen faces kept
+	 * @param scratchPath the file holding the preprocessed faces during training, removed afterwards
+	 * @param memoryBudget bytes of image data held in memory at once
+	 */
+	void trainOutOfCore(const std::string& dir, int max, int components, const std::string& scratchPath, size_t memoryBudget = 512 << 20);
+
+	/*
+	 * Fold new samples into the trained model with an incremental PCA update instead of retraining from scratch.
+	 * The mean image and the eigen basis are updated in place, and the weights of the new samples are appended to trainingValue.
+	 * The whole model is retrained from raw only when the energy of the new samples outside the current basis is too large.
+	 * A model trained out of core has no images in raw, it is retrained out of core from the image files, see setScratchPath.
+	 * @param samples new gray scaled samples, in the format produced by ImageReader::loadDataSet
+	 * @param maxDrift the maximum ratio of residual energy to total energy of the update before a full retrain, in [0,1]
+	 * @param useCasClassifier locate the faces with the eye-face template only when false, the same as train
+	 */
+	void update(const std::vector<DataObject>& samples, double maxDrift = 0.25, bool useCasClassifier = true);
+
+	/*
+	 * Set the scratch file of the out of core retrain of update, trainOutOfCore sets it to its own.
+	 * A model trained out of core and loaded from model.xml cannot be retrained by update without it.
+	 */
+	void setScratchPath(const std::string& path, size_t memoryBudget = 512 << 20) { scratchPath = path; scratchBudget = memoryBudget; }
+
+	/*
+	 * Find the training images most similar to the given image and show the closest one.
+	 * @param k the number of matches returned
+	 * @return the matches sorted by dist, empty when no face can be located
+	 */
+	std::vector<Match> recognizeImage(const DataObject& obj, bool useCasClassifier = true, int k = 5);
+
+	/*
+	 * Recognize many images without any GUI.
+	 * The images are preprocessed in parallel and projected to the eigen space by one multiplication.
+	 * @param objs color or gray scaled images, aligned by the eye pos when it is valid, otherwise located by the classifier
+	 * @param k the number of matches of every image
+	 * @return one result for every image, in the same order
+	 */
+	std::vector<RecognizeResult> recognizeBatch(const std::vector<DataObject>& objs, bool useCasClassifier = true, int k = 5) const;
+
+	/*
+	 * Recognize faces already located, e.g. by a tracker, without running the classifier.
+	 * Every rect is normalized like a face found by the classifier in recognizeBatch, so the crops match the training faces.
+	 * @param images gray scaled images, the same image may be given for several faces
+	 * @param faces the face rect in every image
+	 * @param k the number of matches of every face
+	 * @return one result for every face, in the same order, the file names are empty
+	 */
+	std::vector<RecognizeResult> recognizeFaces(const std::vector<cv::Mat>& images, const std::vector<cv::Rect>& faces, int k = 5) const;
+
+	// file name of the i-th training image
+	const std::string& getImageName(int i) const { return raw.at(i).filename; }
+	// identity of the i-th training image, empty when unknown
+	const std::string& getIdentity(int i) const { return raw.at(i).identity; }
+
+	/*
+	 * Search one template per identity, the class mean of the weights of its images, instead of every image.
+	 * A template match reports the image closest to the class mean. The templates are built by train and update, and saved with the model.
+	 * @param rerank the number of nearest identities whose images are then searched one by one, only the templates when 0, disabled when negative
+	 */
+	void useTemplates(int rerank = 0);
+
+	/*
+	 * Label the training images by a manifest instead of their file names, see ImageReader::loadIdentityManifest.
+	 * Takes effect when the templates are built.
+	 */
+	void setIdentityManifest(const std::string& path);
+
+	/*
+	 * Enable the approximate nearest neighbour index over the training weights.
+	 * The index is built by train and update, and saved with the model.
+	 * @param listNum the number of inverted lists, sqrt(image_num) when 0, disabled when negative
+	 */
+	void useIndex(int listNum = 0);
+
+	/*
+	 * Set the number of inverted lists scanned by a query. More lists give a better recall and a higher latency.
+	 * @param num the number of lists, exact search when not positive
+	 */
+	void setProbeNum(int num) { probeNum = num; }
+
+	/*
+	 * Share a face detector, e.g. one with different detection parameters, instead of the default one.
+	 */
+	void setFaceDetector(const cv::Ptr<FaceDetector>& detector) { faceDetector = detector; }
+	// the detector of preprocess and recognition, e.g. for a tracker that locates the faces itself
+	const FaceDetector& getFaceDetector() const { return *faceDetector; }
+
+	/*
+	 * Resize all preprocessed faces to a fixed size instead of the average size of the detected faces.
+	 * Detection and normalization then run as one pass. Takes effect at the next train.
+	 */
+	void setCanonicalSize(const cv::Size& size) { canonicalSize = size; }
+
+	/*
+	 * Store the eigen basis in reduced precision, which is also saved with the model.
+	 * The float basis is released, and the weights are projected by widening the stored values with float accumulation.
+	 */
+	void setPrecision(Precision p);
+	Precision getPrecision() const { return precision; }
+	// memory used by the eigen basis
+	size_t basisBytes() const { return precision == Precision::FP32 ? tEigenVector.total() * tEigenVector.elemSize() : quantizedBasis.bytes(); }
+
+	void saveModel(const std::string& path);
+	void loadModel(const std::string& path);
+
+	/*
+	 * Write everything recognition needs as one flat binary file, see MappedModelHeader.
+	 * Unlike model.xml it can be mapped without parsing, the source images are not included.
+	 * The identity templates are included when they are enabled, with the identity of every image.
+	 * @param path the file to write
+	 */
+	bool exportMappedModel(const std::string& path) const;
+
+	/*
+	 * Map a file written by exportMappedModel and use it in place, nothing but the names, the identities and the list offsets is copied.
+	 * Processes mapping the same file share one physical copy of the model. The mapped model is read-only,
+	 * it can recognize but not be updated, and train replaces it with a new in-memory model.
+	 */
+	bool mapModel(const std::string& path);
+
+	/*
+	 * Convert the eigen vector to image format and output it, the model is left untouched.
+	 * @param num the number of output images, at most the number of eigen faces
+	 */
+	std::vector<cv::Mat> outputEigenFace(int num) const;
+
+	/*
+	 * Write the first num eigen faces as one image, tiled cols per row.
+	 * @param path the output image, e.g. eigenfaces.png
+	 */
+	bool exportEigenFaces(const std::string& path, int num = 10, int cols = 5) const;
+
+	cv::Mat getAvgMat() { return avgMat; }
+	cv::Mat getDiffMat() { return diffMat; }
+	cv::Mat getCovMat() { return covMat; }
+	cv::Mat getEigenVector() { return eigenVector; }
+
+	// just don't use it
+	void saveAllImages(const std::string& dir) const;
+	// just don't use it
+	void saveAllRawImages(const std::string& dir) const;
+};
+
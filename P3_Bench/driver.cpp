@@ -0,0 +1,255 @@
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include "TrainDataSet.h"
+#include "ImageReader.h"
+
+
+// samples of every generated identity
+constexpr int SyntheticPerIdentity = 10;
+// probes recognized one at a time to measure the latency of a single request
+constexpr int LatencyProbes = 50;
+// matches counted by the top-k accuracy
+constexpr int TopK = 5;
+// model written and read back by the save/load stage
+constexpr char BenchModelPath[] = "bench_";
+
+struct BenchResult
+{
+	int n = 0;
+	int galleryNum = 0;
+	int probeNum = 0;
+	double loadSet = 0;
+	TrainTimings train;
+	double saveModel = 0;
+	double loadModel = 0;
+	// ms per probe, recognized all at once and one by one
+	double batchProbe = 0;
+	double singleProbe = 0;
+	// ratio of the valid probes with a match of the same identity in the first 1 and TopK matches
+	double top1 = 0;
+	double topK = 0;
+	int validProbes = 0;
+};
+
+double secondsSince(int64 tick)
+{
+	return static_cast<double>(cv::getTickCount() - tick) / cv::getTickFrequency();
+}
+
+/*
+ * Generate n faces of n / SyntheticPerIdentity identities.
+ * Every identity is a smooth random pattern, its samples differ by noise, brightness and a shift of a few pixels.
+ * The eye positions follow the shift, so the eye-face template locates every face.
+ */
+std::vector<DataObject> makeSyntheticSet(int n, uint64 seed)
+{
+	cv::RNG rng(seed);
+	const cv::Size size(200, 200);
+	// eyes of the unshifted pattern
+	const cv::Point left(60, 80), right(140, 80);
+
+	std::vector<DataObject> samples;
+	cv::Mat base;
+	for (int i = 0; i < n; ++i)
+	{
+		int id = i / SyntheticPerIdentity;
+		if (i % SyntheticPerIdentity == 0)
+		{
+			cv::Mat coarse(16, 16, CV_32FC1);
+			rng.fill(coarse, cv::RNG::NORMAL, 128, 40);
+			cv::resize(coarse, base, size, 0, 0, cv::INTER_CUBIC);
+		}
+		cv::Mat noise(size, CV_32FC1);
+		rng.fill(noise, cv::RNG::NORMAL, 0, 12);
+		cv::Mat sample = base * rng.uniform(0.85, 1.15) + noise;
+
+		cv::Point shift(rng.uniform(-3, 4), rng.uniform(-3, 4));
+		cv::Mat move = (cv::Mat_<double>(2, 3) << 1, 0, shift.x, 0, 1, shift.y);
+		cv::Mat moved;
+		cv::warpAffine(sample, moved, move, size, cv::INTER_LINEAR, cv::BORDER_REFLECT);
+
+		DataObject obj;
+		moved.convertTo(obj.image, CV_8U);
+		obj.eye = { left.x + shift.x, left.y + shift.y, right.x + shift.x, right.y + shift.y };
+		obj.filename = "synthetic" + std::to_string(id) + "_" + std::to_string(i % SyntheticPerIdentity);
+		obj.identity = ImageReader::parseIdentity(obj.filename);
+		samples.push_back(obj);
+	}
+	return samples;
+}
+
+// hold out the first holdOut of the samples of every identity with more than one sample, at least one sample stays in the gallery
+void splitHoldOut(const std::vector<DataObject>& samples, double holdOut, std::vector<DataObject>& gallery, std::vector<DataObject>& probes)
+{
+	std::map<std::string, std::vector<int>> identities;
+	for (int i = 0; i < samples.size(); ++i)
+		identities[samples[i].identity].push_back(i);
+
+	for (auto& identity : identities)
+	{
+		auto& ids = identity.second;
+		int size = static_cast<int>(ids.size());
+		int held = size < 2 || holdOut <= 0 ? 0 : std::min(size - 1, std::max(1, cvRound(size * holdOut)));
+		for (int j = 0; j < size; ++j)
+			(j < held ? probes : gallery).push_back(samples[ids[j]]);
+	}
+}
+
+BenchResult runOnce(const std::string& dataPath, int n, double holdOut, int indexLists, int templateRerank)
+{
+	BenchResult res;
+	bool synthetic = dataPath == "synthetic";
+
+	int64 tick = cv::getTickCount();
+	std::vector<DataObject> samples = synthetic ? makeSyntheticSet(n, 0x5eed) : ImageReader::loadDataSet(dataPath, n);
+	res.loadSet = secondsSince(tick);
+	res.n = static_cast<int>(samples.size());
+
+	std::vector<DataObject> gallery, probes;
+	splitHoldOut(samples, holdOut, gallery, probes);
+	res.galleryNum = static_cast<int>(gallery.size());
+	res.probeNum = static_cast<int>(probes.size());
+
+	// the generated faces are located by their eye positions only
+	bool useCasClassifier = !synthetic;
+	{
+		TrainDataSet model;
+		model.setDataSet(gallery);
+		if (indexLists >= 0)
+			model.useIndex(indexLists);
+		model.useTemplates(templateRerank);
+		model.train(useCasClassifier);
+		res.train = model.getTimings();
+
+		tick = cv::getTickCount();
+		model.saveModel(BenchModelPath);
+		res.saveModel = secondsSince(tick);
+	}
+
+	// recognize with the model read back, so the probes also check that nothing is lost by saving
+	TrainDataSet model;
+	tick = cv::getTickCount();
+	model.loadModel(BenchModelPath);
+	res.loadModel = secondsSince(tick);
+	std::remove((std::string(BenchModelPath) + "model.xml").c_str());
+
+	if (probes.empty())
+		return res;
+
+	tick = cv::getTickCount();
+	auto results = model.recognizeBatch(probes, useCasClassifier, TopK);
+	res.batchProbe = secondsSince(tick) * 1000 / probes.size();
+
+	int single = std::min(LatencyProbes, res.probeNum);
+	tick = cv::getTickCount();
+	for (int i = 0; i < single; ++i)
+		model.recognizeBatch({ probes[i] }, useCasClassifier, TopK);
+	res.singleProbe = secondsSince(tick) * 1000 / single;
+
+	int top1 = 0, topK = 0;
+	for (int i = 0; i < results.size(); ++i)
+	{
+		if (!results[i].valid || results[i].matches.empty())
+			continue;
+		res.validProbes++;
+		const std::string& identity = probes[i].identity;
+		auto& matches = results[i].matches;
+		if (model.getIdentity(matches[0].index) == identity)
+			top1++;
+		if (std::any_of(matches.begin(), matches.end(), [&](const Match& m) { return model.getIdentity(m.index) == identity; }))
+			topK++;
+	}
+	if (res.validProbes > 0)
+	{
+		res.top1 = static_cast<double>(top1) / res.validProbes;
+		res.topK = static_cast<double>(topK) / res.validProbes;
+	}
+	return res;
+}
+
+// split "100,200,400"
+std::vector<int> parseSizes(const std::string& str)
+{
+	std::vector<int> sizes;
+	std::stringstream ss(str);
+	std::string item;
+	while (std::getline(ss, item, ','))
+		if (!item.empty())
+			sizes.push_back(std::stoi(item));
+	return sizes;
+}
+
+constexpr char CsvHeader[] = "n,gallery,probes,load_s,preprocess_s,avg_diff_s,cov_s,eigen_s,training_value_s,index_s,precision_s,save_s,load_model_s,batch_ms_per_probe,single_ms_per_probe,top1,top5\n";
+
+void writeRow(std::ostream& out, const BenchResult& r)
+{
+	out << r.n << "," << r.galleryNum << "," << r.probeNum << "," << r.loadSet << ","
+		<< r.train.preprocess << "," << r.train.avgAndDiff << "," << r.train.covMat << "," << r.train.eigenVector << ","
+		<< r.train.trainingValue << "," << r.train.index << "," << r.train.precision << ","
+		<< r.saveModel << "," << r.loadModel << "," << r.batchProbe << "," << r.singleProbe << ","
+		<< r.top1 << "," << r.topK << "\n";
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		std::cout << "Usage: mybench [DataPath] [Sizes] [optional:HoldOut] [optional:IndexLists] [optional:CsvPath] [optional:TemplateRerank]\n";
+		std::cout << "DataPath: The path of the data set, or \"synthetic\" to generate faces of " << SyntheticPerIdentity << " samples per identity\n";
+		std::cout << "Sizes: Comma separated numbers of images, e.g. 100,200,400. Every size is loaded, trained and recognized from scratch\n";
+		std::cout << "HoldOut(default 0.2): The ratio of the images of every identity recognized as probes instead of trained\n";
+		std::cout << "IndexLists(default -1): The number of lists of the approximate search index, 0 for sqrt(gallery size), no index when negative\n";
+		std::cout << "CsvPath: Also write the results to this csv file\n";
+		std::cout << "TemplateRerank(default -1): Search one template per identity, then the images of this many nearest identities, every image when negative\n";
+		std::cout << "The identity of an image is its file name up to the last '_', accuracy needs at least two images of an identity\n";
+		return -1;
+	}
+	std::string dataPath = argv[1];
+	std::vector<int> sizes = parseSizes(argv[2]);
+	double holdOut = argc >= 4 ? std::stod(argv[3]) : 0.2;
+	int indexLists = argc >= 5 ? std::stoi(argv[4]) : -1;
+	int templateRerank = argc >= 7 ? std::stoi(argv[6]) : -1;
+
+	std::vector<BenchResult> results;
+	for (int n : sizes)
+	{
+		std::cout << "Running N = " << n << std::endl;
+		results.push_back(runOnce(dataPath, n, holdOut, indexLists, templateRerank));
+	}
+
+	// one row per size, the growth of every column along N is the scaling curve of the stage
+	std::cout << std::fixed << std::setprecision(3);
+	std::cout << "\n       N  gallery   load  preproc  avgdiff     cov   eigen  weights   index    save    load  ms/probe  ms/single   top1  top" << TopK << "\n";
+	for (auto& r : results)
+	{
+		std::cout << std::setw(8) << r.n << std::setw(9) << r.galleryNum
+			<< std::setw(7) << r.loadSet << std::setw(9) << r.train.preprocess << std::setw(9) << r.train.avgAndDiff
+			<< std::setw(8) << r.train.covMat << std::setw(8) << r.train.eigenVector << std::setw(9) << r.train.trainingValue
+			<< std::setw(8) << r.train.index << std::setw(8) << r.saveModel << std::setw(8) << r.loadModel
+			<< std::setw(10) << r.batchProbe << std::setw(11) << r.singleProbe
+			<< std::setw(7) << r.top1 << std::setw(6) << r.topK << "\n";
+	}
+	std::cout << "Times in seconds unless noted. The mean and the difference images are calculated in one pass, reported as avgdiff.\n";
+
+	if (argc >= 6 && argv[5][0] != '\0')
+	{
+		std::fstream csv(argv[5], std::ios::out);
+		if (!csv.is_open())
+		{
+			std::cout << "Cannot open output " << argv[5] << std::endl;
+			return -1;
+		}
+		csv << CsvHeader;
+		for (auto& r : results)
+			writeRow(csv, r);
+		csv.close();
+	}
+	return 0;
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+
+/*
+ * Blocking FIFO queue with a fixed capacity, shared by producer and consumer threads.
+ * push blocks while the queue is full, so a slow consumer throttles its producers.
+ */
+template <typename T>
+class BoundedQueue
+{
+	std::deque<T> items;
+	size_t capacity;
+	bool closed = false;
+	mutable std::mutex mutex;
+	std::condition_variable notEmpty, notFull;
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+	// @return false when the queue is closed, the item is dropped
+	bool push(T item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+		if (closed)
+			return false;
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	// @return false when the queue is closed and drained
+	bool pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+		if (items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	/*
+	 * Block until an item arrives, then keep collecting for at most wait, or until max items are taken.
+	 * @return false when the queue is closed and drained
+	 */
+	template <typename Rep, typename Period>
+	bool popBatch(std::vector<T>& batch, size_t max, std::chrono::duration<Rep, Period> wait)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+		auto deadline = std::chrono::steady_clock::now() + wait;
+		while (batch.size() < max)
+		{
+			if (items.empty() && !notEmpty.wait_until(lock, deadline, [this] { return closed || !items.empty(); }))
+				break;
+			if (items.empty())
+				break;
+			batch.push_back(std::move(items.front()));
+			items.pop_front();
+			notFull.notify_one();
+		}
+		return !batch.empty();
+	}
+
+	// wake every waiting thread, pop still returns the remaining items
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		notEmpty.notify_all();
+		notFull.notify_all();
+	}
+
+	size_t size() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return items.size();
+	}
+};
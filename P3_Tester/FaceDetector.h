@@ -0,0 +1,54 @@
+#pragma once
+#include <opencv2/objdetect.hpp>
+#include <opencv2/core/utility.hpp>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// '/' is a separator on every platform
+constexpr char DefaultCascadePath[] = "./data/haarcascade_frontalface_default.xml";
+
+// Parameters passed to detectMultiScale
+struct DetectorParams
+{
+	double scaleFactor = 1.1;
+	int minNeighbors = 3;
+	// no limit when empty
+	cv::Size minSize;
+	cv::Size maxSize;
+};
+
+/*
+ * Face detector shared by all threads.
+ * The cascade file is parsed once, then every thread builds its own classifier from the parsed cascade the first time it detects.
+ */
+class FaceDetector
+{
+	cv::FileStorage cascade;
+	// FileStorage nodes are not safe to read concurrently
+	mutable std::mutex cascadeMutex;
+	cv::TLSData<cv::CascadeClassifier> classifiers;
+	DetectorParams params;
+	bool loaded = false;
+public:
+	/*
+	 * @param path the cascade classifier xml file
+	 */
+	explicit FaceDetector(const std::string& path = DefaultCascadePath, const DetectorParams& params = DetectorParams());
+
+	FaceDetector(const FaceDetector&) = delete;
+	FaceDetector& operator=(const FaceDetector&) = delete;
+
+	// true when the cascade cannot be loaded
+	bool empty() const { return !loaded; }
+
+	void setParams(const DetectorParams& p) { params = p; }
+	const DetectorParams& getParams() const { return params; }
+
+	/*
+	 * Detect faces in a gray scaled image with the classifier of the calling thread.
+	 * @return face rects, the largest first
+	 */
+	std::vector<cv::Rect> detect(const cv::Mat& gray) const;
+};
@@ -2,6 +2,7 @@
 #include <opencv2/imgproc.hpp>
 #include <string>
 #include <vector>
+#include <map>
 #include "DataStruct.h"
 
 
@@ -12,6 +13,12 @@ public:
 	static DataObject loadFile(const std::string& filename);
 	// load and create DataObject set with given max size, infinity when negative
 	static std::vector<DataObject> loadDataSet(const std::string& dir, int max = -1);
+	// list the file names of the data set without loading any image, suffix is discarded, infinity when max is negative
+	static std::vector<std::string> listDataSet(const std::string& dir, int max = -1);
+	// identity in a file name of the form [Identity]_[Index], the file name without its directory when there is no '_'
+	static std::string parseIdentity(const std::string& filename);
+	// read a manifest with one "[ImageName] [Identity]" per line, ImageName is the file name without directory and suffix
+	static std::map<std::string, std::string> loadIdentityManifest(const std::string& path);
 	// why does a reader have a write function?
 	static void writeDataSet(const std::string& dir, const std::vector<DataObject>& dataset);
 };
@@ -0,0 +1,60 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <vector>
+#include "DataStruct.h"
+
+
+/*
+ * Inverted file index over the training weights.
+ * The weights are clustered with k-means, a query only scans the lists of its nearest centroids.
+ */
+class IvfIndex
+{
+	// list_num * eigen_num, the center of every list
+	cv::Mat centroids;
+	// list_num * 1, squared norm of every centroid
+	cv::Mat centroidNorm;
+	// list_num + 1, list i holds ids[offsets[i]] to ids[offsets[i + 1] - 1]
+	std::vector<int> offsets;
+	// training image index of every weight, grouped by list
+	std::vector<int> ids;
+	// the weights reordered by list so that every list is continuous, rebuilt from the gallery instead of being saved
+	cv::Mat vectors;
+	cv::Mat vectorNorm;
+
+	// reorder the gallery rows by list
+	void gather(const cv::Mat& gallery);
+public:
+	/*
+	 * Cluster the gallery and build the inverted lists.
+	 * @param gallery CV_32FC1 mat, one weight per row
+	 * @param listNum the number of lists, sqrt(gallery rows) when not positive
+	 */
+	void build(const cv::Mat& gallery, int listNum = 0);
+
+	/*
+	 * Find the k nearest rows of the gallery in the probeNum lists closest to query.
+	 * Scanning more lists gives better recall at a higher latency.
+	 */
+	std::vector<Match> search(const cv::Mat& query, int k, int probeNum) const;
+
+	bool empty() const { return centroids.empty(); }
+	int listNum() const { return centroids.rows; }
+	void clear();
+
+	/*
+	 * Use the given mats directly instead of building, e.g. mats pointing into a mapped model.
+	 * vectors and vectorNorm are the gallery rows reordered by list.
+	 */
+	void wrap(const cv::Mat& centroids, const std::vector<int>& offsets, const std::vector<int>& ids, const cv::Mat& vectors, const cv::Mat& vectorNorm);
+
+	const cv::Mat& getCentroids() const { return centroids; }
+	const std::vector<int>& getOffsets() const { return offsets; }
+	const std::vector<int>& getIds() const { return ids; }
+	const cv::Mat& getVectors() const { return vectors; }
+	const cv::Mat& getVectorNorm() const { return vectorNorm; }
+
+	void write(cv::FileStorage& fs) const;
+	// gallery should be the same weights the index was built from
+	void read(const cv::FileStorage& fs, const cv::Mat& gallery);
+};
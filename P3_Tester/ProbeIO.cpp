@@ -0,0 +1,101 @@
+#include "ProbeIO.h"
+#include <opencv2/core.hpp>
+#include <opencv2/highgui.hpp>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+
+EyePos loadEP(const std::string& filename)
+{
+	std::fstream eps(filename, std::ios::in);
+	if (!eps.is_open())
+		return InvalidEyePos;
+	EyePos ep;
+	std::string temp;
+
+	// .eye format:
+	// #LX 	LY	RX	RY
+	// 232 	110	161	110
+	std::getline(eps, temp);
+	eps >> ep.RightX >> ep.RightY >> ep.LeftX >> ep.LeftY;
+
+	eps.close();
+
+	return ep;
+}
+
+void parseProbe(const std::string& line, std::string& imgPath, std::string& eyePosPath)
+{
+	imgPath = line.substr(0, line.find(' '));
+	if (line.find(' ') != std::string::npos)
+		eyePosPath = line.substr(line.find(' ') + 1);
+	else
+		eyePosPath.clear();
+}
+
+std::string jsonEscape(const std::string& str)
+{
+	std::string res;
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\')
+			res += '\\';
+		res += c;
+	}
+	return res;
+}
+
+bool readProbeList(const std::string& listPath, std::vector<std::string>& probes)
+{
+	std::fstream list(listPath, std::ios::in);
+	if (!list.is_open())
+	{
+		std::cout << "Cannot open probe list " + listPath << std::endl;
+		return false;
+	}
+	std::string line;
+	while (std::getline(list, line))
+	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (!line.empty())
+			probes.push_back(line);
+	}
+	list.close();
+	return true;
+}
+
+// decoding is as slow as recognizing
+std::vector<DataObject> loadProbes(const std::vector<std::string>& probes, int begin, int end)
+{
+	std::vector<DataObject> objs(end - begin);
+	cv::parallel_for_(cv::Range(begin, end), [&](const cv::Range& range)
+		{
+			for (int i = range.start; i < range.end; ++i)
+			{
+				std::string imgPath, eyePosPath;
+				parseProbe(probes[i], imgPath, eyePosPath);
+				DataObject& obj = objs[i - begin];
+				obj.image = cv::imread(imgPath);
+				obj.eye = eyePosPath.empty() ? InvalidEyePos : loadEP(eyePosPath);
+				obj.filename = imgPath;
+			}
+		});
+	return objs;
+}
+
+std::string resultToJson(const TrainDataSet& data_set, const RecognizeResult& res)
+{
+	std::ostringstream out;
+	out << "{\"probe\": \"" << jsonEscape(res.filename) << "\", \"valid\": " << (res.valid ? "true" : "false") << ", \"matches\": [";
+	for (int i = 0; i < res.matches.size(); ++i)
+	{
+		auto& m = res.matches[i];
+		out << (i == 0 ? "" : ", ") << "{\"index\": " << m.index << ", \"name\": \""
+			<< jsonEscape(data_set.getImageName(m.index)) << "\", \"identity\": \"" << jsonEscape(data_set.getIdentity(m.index))
+			<< "\", \"dist\": " << m.dist << "}";
+	}
+	out << "]}";
+	return out.str();
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "DataStruct.h"
+#include "TrainDataSet.h"
+
+
+/*
+ * Load the eye position of an image from a .eye file.
+ * @return InvalidEyePos when the file cannot be opened
+ */
+EyePos loadEP(const std::string& filename);
+
+// split "[SrcImg] [optional:EyePosPath]"
+void parseProbe(const std::string& line, std::string& imgPath, std::string& eyePosPath);
+
+// read the non empty lines of a probe list
+bool readProbeList(const std::string& listPath, std::vector<std::string>& probes);
+
+/*
+ * Decode the probes in [begin, end) in parallel.
+ * @param probes lines in the format "[SrcImg] [optional:EyePosPath]"
+ */
+std::vector<DataObject> loadProbes(const std::vector<std::string>& probes, int begin, int end);
+
+std::string jsonEscape(const std::string& str);
+
+// one json object with the probe, whether a face was found and the matches with the names and identities of the training images
+std::string resultToJson(const TrainDataSet& data_set, const RecognizeResult& res);
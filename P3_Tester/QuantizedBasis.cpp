@@ -0,0 +1,158 @@
+#include "QuantizedBasis.h"
+#include <opencv2/core/hal/intrin.hpp>
+#include <algorithm>
+
+
+// probes projected together, and the pixels of them projected at once, 8 probes * 2048 floats fit in L2
+constexpr int ProjectProbes = 8;
+constexpr int ProjectPixels = 2048;
+
+float dotHalf(const cv::float16_t* p, const float* q, int len)
+{
+	int j = 0;
+	float s = 0;
+#if CV_SIMD
+	const int lanes = cv::v_float32::nlanes;
+	cv::v_float32 v = cv::vx_setzero_f32();
+	for (; j <= len - lanes; j += lanes)
+		v = cv::v_fma(cv::vx_load_expand(p + j), cv::vx_load(q + j), v);
+	s = cv::v_reduce_sum(v);
+#endif
+	for (; j < len; ++j)
+		s += static_cast<float>(p[j]) * q[j];
+	return s;
+}
+
+float dotInt8(const schar* p, const float* q, int len)
+{
+	int j = 0;
+	float s = 0;
+#if CV_SIMD
+	const int lanes = cv::v_float32::nlanes;
+	cv::v_float32 v = cv::vx_setzero_f32();
+	for (; j <= len - lanes; j += lanes)
+		v = cv::v_fma(cv::v_cvt_f32(cv::vx_load_expand_q(p + j)), cv::vx_load(q + j), v);
+	s = cv::v_reduce_sum(v);
+#endif
+	for (; j < len; ++j)
+		s += p[j] * q[j];
+	return s;
+}
+
+void QuantizedBasis::quantize(const cv::Mat& basis, Precision p)
+{
+	CV_Assert(basis.type() == CV_32FC1 && p != Precision::FP32);
+	release();
+	precision = p;
+
+	if (precision == Precision::FP16)
+	{
+		cv::Mat half;
+		basis.convertTo(half, CV_16F);
+		// keep the bits as CV_16S, which every FileStorage version can store
+		data = cv::Mat(half.rows, half.cols, CV_16SC1, half.data, half.step).clone();
+		return;
+	}
+
+	// symmetric per row scale, the eigen vectors are centred around 0
+	data.create(basis.rows, basis.cols, CV_8SC1);
+	scale.create(basis.rows, 1, CV_32FC1);
+	for (int i = 0; i < basis.rows; ++i)
+	{
+		double maxAbs;
+		cv::minMaxLoc(cv::abs(basis.row(i)), nullptr, &maxAbs);
+		float s = maxAbs > 0 ? static_cast<float>(maxAbs / 127) : 1.0f;
+		scale.at<float>(i) = s;
+		basis.row(i).convertTo(data.row(i), CV_8S, 1 / s);
+	}
+}
+
+cv::Mat QuantizedBasis::dequantize() const
+{
+	cv::Mat basis;
+	if (precision == Precision::FP16)
+		cv::Mat(data.rows, data.cols, CV_16FC1, data.data, data.step).convertTo(basis, CV_32F);
+	else if (precision == Precision::INT8)
+	{
+		basis.create(data.rows, data.cols, CV_32FC1);
+		for (int i = 0; i < basis.rows; ++i)
+			data.row(i).convertTo(basis.row(i), CV_32F, scale.at<float>(i));
+	}
+	return basis;
+}
+
+cv::Mat QuantizedBasis::project(const cv::Mat& diff) const
+{
+	CV_Assert(diff.type() == CV_32FC1 && diff.cols == data.cols);
+
+	cv::Mat weight(data.rows, diff.rows, CV_32FC1, cv::Scalar(0));
+	if (weight.empty())
+		return weight;
+	int len = data.cols;
+
+	// a tile of probes is split into blocks of pixels small enough to stay in cache while every basis row passes over it,
+	// so each probe is read from memory once instead of once per eigen vector
+	int tiles = (diff.rows + ProjectProbes - 1) / ProjectProbes;
+	// few probes are split over the basis rows too, so a single probe still uses every thread
+	int rowBlocks = std::min(data.rows, std::max(1, (cv::getNumThreads() + tiles - 1) / tiles));
+	cv::parallel_for_(cv::Range(0, tiles * rowBlocks), [&](const cv::Range& range)
+		{
+			for (int task = range.start; task < range.end; ++task)
+			{
+				int tile = task / rowBlocks, block = task % rowBlocks;
+				int firstProbe = tile * ProjectProbes, lastProbe = std::min(firstProbe + ProjectProbes, diff.rows);
+				int firstRow = data.rows * block / rowBlocks, lastRow = data.rows * (block + 1) / rowBlocks;
+				for (int begin = 0; begin < len; begin += ProjectPixels)
+				{
+					int n = std::min(ProjectPixels, len - begin);
+					for (int i = firstRow; i < lastRow; ++i)
+					{
+						float* w = weight.ptr<float>(i);
+						for (int j = firstProbe; j < lastProbe; ++j)
+						{
+							if (precision == Precision::FP16)
+								w[j] += dotHalf(reinterpret_cast<const cv::float16_t*>(data.ptr<short>(i)) + begin, diff.ptr<float>(j) + begin, n);
+							else
+								w[j] += dotInt8(data.ptr<schar>(i) + begin, diff.ptr<float>(j) + begin, n) * scale.at<float>(i);
+						}
+					}
+				}
+			}
+		});
+
+	return weight;
+}
+
+void QuantizedBasis::release()
+{
+	precision = Precision::FP32;
+	data.release();
+	scale.release();
+}
+
+void QuantizedBasis::wrap(Precision p, const cv::Mat& data, const cv::Mat& scale)
+{
+	precision = p;
+	this->data = data;
+	this->scale = scale;
+}
+
+void QuantizedBasis::write(cv::FileStorage& fs) const
+{
+	fs << "QuantizedEigenVector" << data;
+	if (precision == Precision::INT8)
+		fs << "EigenScale" << scale;
+}
+
+void QuantizedBasis::read(const cv::FileStorage& fs)
+{
+	release();
+	int p = 0;
+	fs["EigenPrecision"] >> p;
+	if (p == static_cast<int>(Precision::FP32))
+		return;
+	precision = static_cast<Precision>(p);
+	fs["QuantizedEigenVector"] >> data;
+	if (precision == Precision::INT8)
+		fs["EigenScale"] >> scale;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <opencv2/core.hpp>
+
+
+// Storage precision of the eigen basis
+enum class Precision
+{
+	FP32 = 0,
+	FP16 = 1,
+	// 8 bit integer with one float scale per eigen vector
+	INT8 = 2
+};
+
+/*
+ * Eigen basis stored in reduced precision.
+ * Projection widens the stored values on the fly and accumulates in float.
+ */
+class QuantizedBasis
+{
+	Precision precision = Precision::FP32;
+	// eigen_num * pixel_num, the bits of float16 as CV_16SC1, or CV_8SC1
+	cv::Mat data;
+	// eigen_num * 1, the scale of every row for int8
+	cv::Mat scale;
+public:
+	/*
+	 * @param basis CV_32FC1, one eigen vector per row
+	 * @param p FP16 or INT8
+	 */
+	void quantize(const cv::Mat& basis, Precision p);
+
+	// widen back to CV_32FC1
+	cv::Mat dequantize() const;
+
+	/*
+	 * Project centred images onto the basis.
+	 * @param diff CV_32FC1, one image per row
+	 * @return eigen_num * image_num CV_32FC1, the same as basis * diff'
+	 */
+	cv::Mat project(const cv::Mat& diff) const;
+
+	bool empty() const { return data.empty(); }
+	Precision getPrecision() const { return precision; }
+	int rows() const { return data.rows; }
+	int cols() const { return data.cols; }
+	// memory used by the basis
+	size_t bytes() const { return data.total() * data.elemSize() + scale.total() * scale.elemSize(); }
+	void release();
+
+	// use the given mats directly, e.g. mats pointing into a mapped model
+	void wrap(Precision p, const cv::Mat& data, const cv::Mat& scale);
+	const cv::Mat& getData() const { return data; }
+	const cv::Mat& getScale() const { return scale; }
+
+	void write(cv::FileStorage& fs) const;
+	void read(const cv::FileStorage& fs);
+};
@@ -0,0 +1,301 @@
+#include "RecognitionServer.h"
+#include "BoundedQueue.h"
+#include "ProbeIO.h"
+#include "TrainDataSet.h"
+#include <opencv2/core.hpp>
+#include <opencv2/highgui.hpp>
+#include <iostream>
+#include <sstream>
+#include <future>
+#include <thread>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <list>
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+
+#ifdef _WIN32
+
+int runServer(const std::string& mappedModelPath, const ServerOptions& options)
+{
+	std::cout << "Server mode needs unix domain sockets and fork, it is not supported on Windows.\n";
+	return -1;
+}
+
+#else
+
+struct ServerRequest
+{
+	std::string line;
+	std::chrono::steady_clock::time_point arrival;
+	std::promise<std::string> reply;
+};
+
+// one client, the socket is closed by the worker after the thread is joined
+struct Connection
+{
+	int fd = -1;
+	std::atomic<bool> done{ false };
+	std::thread thread;
+};
+
+// latencies of the most recent requests of one worker
+class LatencyWindow
+{
+	static constexpr size_t WindowSize = 4096;
+	std::vector<double> window;
+	size_t next = 0;
+	long long served = 0;
+	mutable std::mutex mutex;
+public:
+	void add(double ms)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (window.size() < WindowSize)
+			window.push_back(ms);
+		else
+			window[next] = ms;
+		next = (next + 1) % WindowSize;
+		served++;
+	}
+
+	std::string json(size_t queueDepth) const
+	{
+		std::vector<double> sorted;
+		long long count;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			sorted = window;
+			count = served;
+		}
+		std::sort(sorted.begin(), sorted.end());
+		auto percentile = [&sorted](double p) {
+			return sorted.empty() ? 0.0 : sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+		};
+		std::ostringstream out;
+		out << "{\"pid\": " << getpid() << ", \"queue\": " << queueDepth << ", \"served\": " << count
+			<< ", \"p50_ms\": " << percentile(0.50) << ", \"p95_ms\": " << percentile(0.95) << ", \"p99_ms\": " << percentile(0.99) << "}";
+		return out.str();
+	}
+};
+
+bool sendAll(int fd, const std::string& str)
+{
+	size_t sent = 0;
+	while (sent < str.size())
+	{
+		ssize_t n = send(fd, str.data() + sent, str.size() - sent, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		sent += n;
+	}
+	return true;
+}
+
+// read the lines of one connection, replies are sent in the order of the requests
+void serveConnection(int fd, BoundedQueue<std::shared_ptr<ServerRequest>>& queue, const LatencyWindow& latency, std::atomic<bool>& done)
+{
+	std::string pending;
+	char buf[4096];
+	bool open = true;
+	while (open)
+	{
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		pending.append(buf, n);
+
+		// queue every complete line first, so pipelined requests of one client share a batch
+		std::vector<std::future<std::string>> replies;
+		size_t lineEnd;
+		while ((lineEnd = pending.find('\n')) != std::string::npos)
+		{
+			std::string line = pending.substr(0, lineEnd);
+			pending.erase(0, lineEnd + 1);
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (line.empty())
+				continue;
+			if (line == "STATS")
+			{
+				std::promise<std::string> stats;
+				stats.set_value(latency.json(queue.size()));
+				replies.push_back(stats.get_future());
+				continue;
+			}
+			auto request = std::make_shared<ServerRequest>();
+			request->line = line;
+			request->arrival = std::chrono::steady_clock::now();
+			replies.push_back(request->reply.get_future());
+			if (!queue.push(request))
+			{
+				open = false;
+				break;
+			}
+		}
+		for (auto& reply : replies)
+			if (!open || !sendAll(fd, reply.get() + "\n"))
+			{
+				open = false;
+				break;
+			}
+	}
+	done = true;
+}
+
+// join the connection threads, all of them or only the finished ones, and close their sockets
+void joinConnections(std::list<Connection>& connections, bool all)
+{
+	for (auto it = connections.begin(); it != connections.end();)
+	{
+		if (!all && !it->done)
+		{
+			++it;
+			continue;
+		}
+		// wakes a thread blocked in recv, the queue is already closed so it stops at once
+		if (all)
+			shutdown(it->fd, SHUT_RDWR);
+		it->thread.join();
+		close(it->fd);
+		it = connections.erase(it);
+	}
+}
+
+// recognize the queued requests in batches until the queue is closed
+void recognizeQueued(const TrainDataSet& model, const ServerOptions& options, BoundedQueue<std::shared_ptr<ServerRequest>>& queue, LatencyWindow& latency)
+{
+	std::vector<std::shared_ptr<ServerRequest>> batch;
+	while (queue.popBatch(batch, options.maxBatch, std::chrono::microseconds(options.batchWindow)))
+	{
+		std::vector<std::string> lines;
+		for (auto& request : batch)
+			lines.push_back(request->line);
+		std::vector<DataObject> objs = loadProbes(lines, 0, static_cast<int>(lines.size()));
+		auto results = model.recognizeBatch(objs, true, options.topK);
+
+		auto now = std::chrono::steady_clock::now();
+		for (int i = 0; i < batch.size(); ++i)
+		{
+			batch[i]->reply.set_value(resultToJson(model, results[i]));
+			latency.add(std::chrono::duration<double, std::milli>(now - batch[i]->arrival).count());
+		}
+		batch.clear();
+	}
+}
+
+void serveWorker(int listenFd, const TrainDataSet& model, const ServerOptions& options)
+{
+	BoundedQueue<std::shared_ptr<ServerRequest>> queue(options.queueCapacity);
+	LatencyWindow latency;
+	std::thread batcher(recognizeQueued, std::cref(model), std::cref(options), std::ref(queue), std::ref(latency));
+	// the threads reference queue and latency, every one is joined before they go out of scope
+	std::list<Connection> connections;
+
+	while (true)
+	{
+		int fd = accept(listenFd, nullptr, nullptr);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			std::cout << "Worker " << getpid() << " stops accepting: " << std::strerror(errno) << std::endl;
+			break;
+		}
+		joinConnections(connections, false);
+		connections.emplace_back();
+		Connection& connection = connections.back();
+		connection.fd = fd;
+		connection.thread = std::thread(serveConnection, fd, std::ref(queue), std::cref(latency), std::ref(connection.done));
+	}
+	queue.close();
+	joinConnections(connections, true);
+	batcher.join();
+}
+
+int runServer(const std::string& mappedModelPath, const ServerOptions& options)
+{
+	// a client closing early must not kill the worker
+	signal(SIGPIPE, SIG_IGN);
+
+	// mapped once here and inherited by every worker, no worker copies the model
+	TrainDataSet model;
+	if (!model.mapModel(mappedModelPath))
+		return -1;
+
+	int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd < 0)
+	{
+		std::cout << "Cannot create socket: " << std::strerror(errno) << std::endl;
+		return -1;
+	}
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (options.socketPath.size() >= sizeof(addr.sun_path))
+	{
+		std::cout << "Socket path " + options.socketPath + " is too long\n";
+		close(listenFd);
+		return -1;
+	}
+	std::strcpy(addr.sun_path, options.socketPath.c_str());
+	unlink(options.socketPath.c_str());
+	if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listenFd, SOMAXCONN) != 0)
+	{
+		std::cout << "Cannot listen on " + options.socketPath + ": " << std::strerror(errno) << std::endl;
+		close(listenFd);
+		return -1;
+	}
+
+	// fork before any thread is started, the opencv thread pool of every worker is created in the worker
+	std::vector<pid_t> workers;
+	for (int i = 0; i < std::max(options.workers, 1); ++i)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			serveWorker(listenFd, model, options);
+			_exit(0);
+		}
+		if (pid < 0)
+			std::cout << "Cannot fork worker " << i << ": " << std::strerror(errno) << std::endl;
+		else
+			workers.push_back(pid);
+	}
+	if (workers.empty())
+	{
+		close(listenFd);
+		unlink(options.socketPath.c_str());
+		return -1;
+	}
+	std::cout << "Serving on " + options.socketPath + " with " << workers.size() << " workers\n";
+
+	while (!workers.empty())
+	{
+		pid_t pid = wait(nullptr);
+		if (pid < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		workers.erase(std::remove(workers.begin(), workers.end(), pid), workers.end());
+	}
+	close(listenFd);
+	unlink(options.socketPath.c_str());
+	return 0;
+}
+
+#endif
@@ -0,0 +1,32 @@
+#pragma once
+#include <string>
+
+
+struct ServerOptions
+{
+	// path of the unix domain socket
+	std::string socketPath;
+	// processes accepting connections, all sharing one mapped model
+	int workers = 4;
+	// requests of one worker recognized by one projection
+	int maxBatch = 32;
+	// how long the first request of a batch waits for more, in microseconds
+	int batchWindow = 2000;
+	// pending requests of one worker before readers block
+	int queueCapacity = 1024;
+	// matches returned for every request
+	int topK = 5;
+};
+
+/*
+ * Serve recognition requests on a unix domain socket until killed.
+ * The model is mapped before the workers are forked, so all of them share one physical copy of it.
+ * Every worker gathers the requests of all its connections and recognizes them in batches.
+ * One request per line, one json line replied per request:
+ *   "[SrcImg] [optional:EyePosPath]" recognizes the image, the reply is the same object as in batch mode
+ *   "STATS" replies the queue depth, requests served and latency percentiles of the worker
+ * Only available on POSIX systems.
+ * @param mappedModelPath a model written by TrainDataSet::exportMappedModel
+ * @return non zero when the server cannot start
+ */
+int runServer(const std::string& mappedModelPath, const ServerOptions& options);
@@ -0,0 +1,280 @@
+#include "VideoRecognizer.h"
+#include "BoundedQueue.h"
+#include <opencv2/highgui.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/videoio.hpp>
+#include <iostream>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <cctype>
+
+
+// decoded frames waiting for the tracker
+constexpr int FrameQueueSize = 8;
+// new tracks waiting for recognition
+constexpr int TrackQueueSize = 64;
+// a tracked box below this normalized correlation triggers the classifier on the next frame
+constexpr double TrackThreshold = 0.6;
+// a detection continues a track when their boxes overlap at least this much
+constexpr double MatchOverlap = 0.3;
+// detections a track may miss before it is dropped
+constexpr int MaxMissed = 2;
+
+struct TrackedFace
+{
+	int id;
+	cv::Rect box;
+	// gray pixels of the last box, matched in the next frame
+	cv::Mat patch;
+	double confidence = 1;
+	int missed = 0;
+};
+
+struct TrackJob
+{
+	int id;
+	// gray frame the track started in, shared by the tracks starting in the same frame
+	cv::Mat frame;
+	cv::Rect box;
+};
+
+struct TrackLabel
+{
+	std::string name;
+	double dist;
+};
+
+double overlapRatio(const cv::Rect& a, const cv::Rect& b)
+{
+	double inter = (a & b).area();
+	double uni = a.area() + b.area() - inter;
+	return uni > 0 ? inter / uni : 0;
+}
+
+// follow the face by matching its last pixels in a window twice the size of the box
+void followFace(const cv::Mat& gray, TrackedFace& track)
+{
+	cv::Rect frame(0, 0, gray.cols, gray.rows);
+	cv::Rect window = cv::Rect(track.box.x - track.box.width / 2, track.box.y - track.box.height / 2, track.box.width * 2, track.box.height * 2) & frame;
+	if (window.width < track.patch.cols || window.height < track.patch.rows)
+	{
+		track.confidence = 0;
+		return;
+	}
+
+	cv::Mat score;
+	cv::matchTemplate(gray(window), track.patch, score, cv::TM_CCOEFF_NORMED);
+	double maxVal;
+	cv::Point maxLoc;
+	cv::minMaxLoc(score, nullptr, &maxVal, nullptr, &maxLoc);
+
+	track.confidence = maxVal;
+	track.box = cv::Rect(window.tl() + maxLoc, track.patch.size());
+	track.patch = gray(track.box).clone();
+}
+
+int runVideo(const TrainDataSet& model, const VideoOptions& options)
+{
+	cv::VideoCapture capture;
+	bool camera = !options.source.empty() && std::all_of(options.source.begin(), options.source.end(), [](unsigned char c) { return std::isdigit(c); });
+	if (camera)
+		capture.open(std::stoi(options.source));
+	else
+		capture.open(options.source);
+	if (!capture.isOpened())
+	{
+		std::cout << "Cannot open video " + options.source << std::endl;
+		return -1;
+	}
+
+	// the detector of the model, the cascade is already parsed
+	const FaceDetector& detector = model.getFaceDetector();
+	if (detector.empty())
+	{
+		std::cout << "Face cascade classifier not found, a video cannot be recognized without it.\n";
+		return -1;
+	}
+
+	// asked before the reader thread owns the capture
+	double fps = capture.get(cv::CAP_PROP_FPS);
+
+	BoundedQueue<cv::Mat> frames(FrameQueueSize);
+	BoundedQueue<TrackJob> jobs(TrackQueueSize);
+	// labels of the live tracks only, a long stream would grow them without bound otherwise
+	std::map<int, TrackLabel> labels;
+	std::set<int> liveTracks;
+	std::mutex labelMutex;
+
+	// decode ahead of the tracker
+	std::thread reader([&]()
+		{
+			cv::Mat frame;
+			while (capture.read(frame) && !frame.empty())
+				if (!frames.push(frame.clone()))
+					break;
+			frames.close();
+		});
+
+	// recognize the new tracks in batches, one projection per batch
+	std::thread recognizer([&]()
+		{
+			std::vector<TrackJob> batch;
+			while (jobs.popBatch(batch, TrackQueueSize, std::chrono::milliseconds(5)))
+			{
+				std::vector<cv::Mat> images;
+				std::vector<cv::Rect> faces;
+				for (auto& job : batch)
+				{
+					images.push_back(job.frame);
+					faces.push_back(job.box);
+				}
+				auto results = model.recognizeFaces(images, faces, 1);
+
+				std::lock_guard<std::mutex> lock(labelMutex);
+				for (int i = 0; i < batch.size(); ++i)
+				{
+					if (results[i].matches.empty())
+						continue;
+					auto& m = results[i].matches[0];
+					const std::string& identity = model.getIdentity(m.index);
+					TrackLabel label = { identity.empty() ? model.getImageName(m.index) : identity, m.dist };
+					std::cout << "Track " << batch[i].id << ": " << label.name << ", dist " << m.dist << std::endl;
+					// the track may have been dropped while it was recognized
+					if (liveTracks.count(batch[i].id) != 0)
+						labels[batch[i].id] = label;
+				}
+				batch.clear();
+			}
+		});
+
+	cv::VideoWriter writer;
+	std::vector<TrackedFace> tracks;
+	int nextId = 0;
+	long long frameNum = 0, detections = 0;
+	bool needDetect = true;
+	int64 start = cv::getTickCount();
+
+	cv::Mat frame, gray;
+	while (frames.pop(frame))
+	{
+		if (frame.channels() == 3)
+			cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+		else
+			gray = frame;
+
+		for (auto& track : tracks)
+		{
+			followFace(gray, track);
+			if (track.confidence < TrackThreshold)
+				needDetect = true;
+		}
+
+		if (needDetect || frameNum % std::max(options.detectEvery, 1) == 0)
+		{
+			detections++;
+			needDetect = false;
+			std::vector<bool> continued(tracks.size(), false);
+			// gray is reused by the next frame, the recognizer gets a copy
+			cv::Mat still;
+			for (auto& face : detector.detect(gray))
+			{
+				// continue the track overlapping the most, or start a new one
+				int best = -1;
+				double bestOverlap = MatchOverlap;
+				for (int t = 0; t < tracks.size(); ++t)
+				{
+					double overlap = overlapRatio(face, tracks[t].box);
+					if (!continued[t] && overlap >= bestOverlap)
+					{
+						best = t;
+						bestOverlap = overlap;
+					}
+				}
+				if (best >= 0)
+				{
+					continued[best] = true;
+					tracks[best].box = face;
+					tracks[best].patch = gray(face).clone();
+					tracks[best].confidence = 1;
+					tracks[best].missed = 0;
+					continue;
+				}
+				TrackedFace track;
+				track.id = nextId++;
+				track.box = face;
+				track.patch = gray(face).clone();
+				tracks.push_back(track);
+				continued.push_back(true);
+				{
+					std::lock_guard<std::mutex> lock(labelMutex);
+					liveTracks.insert(track.id);
+				}
+				if (still.empty())
+					still = gray.clone();
+				jobs.push({ track.id, still, track.box });
+			}
+
+			for (int t = 0; t < tracks.size(); ++t)
+				if (!continued[t])
+					tracks[t].missed++;
+			{
+				std::lock_guard<std::mutex> lock(labelMutex);
+				for (auto& track : tracks)
+				{
+					if (track.missed <= MaxMissed)
+						continue;
+					liveTracks.erase(track.id);
+					labels.erase(track.id);
+				}
+			}
+			tracks.erase(std::remove_if(tracks.begin(), tracks.end(), [](const TrackedFace& t) { return t.missed > MaxMissed; }), tracks.end());
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(labelMutex);
+			for (auto& track : tracks)
+			{
+				auto it = labels.find(track.id);
+				std::string text = it == labels.end() ? "#" + std::to_string(track.id) : it->second.name;
+				cv::rectangle(frame, track.box, cv::Scalar(0, 255, 0), 2);
+				cv::putText(frame, text, track.box.tl() - cv::Point(0, 4), cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 255, 0));
+			}
+		}
+
+		if (!options.outputPath.empty())
+		{
+			if (!writer.isOpened())
+			{
+				writer.open(options.outputPath, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), fps > 0 ? fps : 30, frame.size());
+				if (!writer.isOpened())
+				{
+					std::cout << "Cannot write video " + options.outputPath << std::endl;
+					break;
+				}
+			}
+			writer.write(frame);
+		}
+		else
+		{
+			cv::imshow("Recognition", frame);
+			// esc
+			if (cv::waitKey(1) == 27)
+				break;
+		}
+		frameNum++;
+	}
+
+	// stop decoding when the loop ended early, then drain the recognition of the last tracks
+	frames.close();
+	reader.join();
+	jobs.close();
+	recognizer.join();
+
+	double sec = static_cast<double>(cv::getTickCount() - start) / cv::getTickFrequency();
+	std::cout << frameNum << " frames in " << sec << " s, " << (sec > 0 ? frameNum / sec : 0) << " fps, classifier run on "
+		<< detections << " frames, " << nextId << " tracks recognized\n";
+	return 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+#include "TrainDataSet.h"
+
+
+struct VideoOptions
+{
+	// a video file, or the index of a camera
+	std::string source;
+	// frames between two runs of the face classifier, tracking in between
+	int detectEvery = 10;
+	// the annotated video is written here, shown in a window when empty
+	std::string outputPath;
+};
+
+/*
+ * Recognize the faces of a video or a camera.
+ * Frames are decoded on one thread. The classifier runs only every detectEvery frames, or as soon as a face is
+ * tracked with low confidence. In between, every face box is followed by template matching around its last position.
+ * Every new track is recognized once on a separate thread, and the result is kept for the rest of the track.
+ * @return non zero when the source cannot be opened
+ */
+int runVideo(const TrainDataSet& model, const VideoOptions& options);
@@ -1,18 +1,45 @@
 #include <opencv2/highgui.hpp>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
 #include "TrainDataSet.h"
+#include "ImageReader.h"
+#include "ProbeIO.h"
+#include "RecognitionServer.h"
+#include "VideoRecognizer.h"
 
-EyePos loadEP(const std::string& filename);
+int runBatch(const TrainDataSet& data_set, const std::string& listPath, const std::string& outPath, int k);
+int runCompare(const std::string& modelPath, const std::string& listPath, const std::string& precisionName);
+int runServe(const std::string& modelPath, const ServerOptions& options);
+
+// probes loaded and recognized at once in batch mode
+constexpr int BatchSize = 256;
 
 int main(int argc, char** argv)
 {
 	if (argc < 2)
 	{
 		std::cout << "Usage: mytest [ModelPath] [optional:SrcImg] [optional:EyePosPath]\n";
+		std::cout << "   or: mytest [ModelPath] -batch [ProbeList] [OutputPath] [optional:TopK]\n";
+		std::cout << "   or: mytest [ModelPath] -compare [ProbeList] [Precision]\n";
+		std::cout << "   or: mytest [ModelPath] -serve [SocketPath] [optional:Workers] [optional:MaxBatch]\n";
+		std::cout << "   or: mytest [ModelPath] -video [VideoPath] [optional:DetectEvery] [optional:OutputPath]\n";
 		std::cout << "ModelPath: The path of extracted model file\n";
 		std::cout << "SrcImg: The image needs to be recognized. You can also starts the program first\n";
 		std::cout << "EyePosPath: The path of the eye position of input image. It is optional if you enable face cascade classifier, but cannot handle when classifier cannot find a face\n";
+		std::cout << "ProbeList: A text file with one \"[SrcImg] [optional:EyePosPath]\" per line, recognized without GUI\n";
+		std::cout << "OutputPath: The result file, json when it ends with .json, otherwise csv\n";
+		std::cout << "TopK(default 5): The number of matches reported for every probe\n";
+		std::cout << "Precision: fp16/int8, report the accuracy of ProbeList with the eigen faces in this precision against fp32, and how the matches differ\n";
+		std::cout << "    the identity of a probe is its file name up to the last '_', as for the training images\n";
+		std::cout << "SocketPath: The unix domain socket to serve on, every line sent is a probe recognized as in batch mode, or \"STATS\"\n";
+		std::cout << "Workers(default 4): The number of server processes, all sharing ModelPath/model.bin which is exported from model.xml when missing or older\n";
+		std::cout << "MaxBatch(default 32): The most requests of one worker recognized at once\n";
+		std::cout << "VideoPath: A video file, or the index of a camera. Every face is tracked and recognized once\n";
+		std::cout << "DetectEvery(default 10): Frames between two runs of the face classifier, faces are tracked in between\n";
+		std::cout << "OutputPath: Write the annotated video here instead of showing it\n";
 		return -1;
 	}
 
@@ -21,8 +48,62 @@ int main(int argc, char** argv)
 	EyePos ep = InvalidEyePos;
 
 	std::string modelPath = argv[1];
+
+	if (argc >= 3 && std::string(argv[2]) == "-compare")
+	{
+		if (argc < 5)
+		{
+			std::cout << "Usage: mytest [ModelPath] -compare [ProbeList] [Precision]\n";
+			return -1;
+		}
+		return runCompare(modelPath, argv[3], argv[4]);
+	}
+
+	if (argc >= 3 && std::string(argv[2]) == "-serve")
+	{
+		if (argc < 4)
+		{
+			std::cout << "Usage: mytest [ModelPath] -serve [SocketPath] [optional:Workers] [optional:MaxBatch]\n";
+			return -1;
+		}
+		ServerOptions options;
+		options.socketPath = argv[3];
+		if (argc >= 5)
+			options.workers = std::stoi(argv[4]);
+		if (argc >= 6)
+			options.maxBatch = std::stoi(argv[5]);
+		return runServe(modelPath, options);
+	}
+
 	data_set.loadModel(modelPath);
 
+	if (argc >= 3 && std::string(argv[2]) == "-batch")
+	{
+		if (argc < 5)
+		{
+			std::cout << "Usage: mytest [ModelPath] -batch [ProbeList] [OutputPath] [optional:TopK]\n";
+			return -1;
+		}
+		int k = argc >= 6 ? std::stoi(argv[5]) : 5;
+		return runBatch(data_set, argv[3], argv[4], k);
+	}
+
+	if (argc >= 3 && std::string(argv[2]) == "-video")
+	{
+		if (argc < 4)
+		{
+			std::cout << "Usage: mytest [ModelPath] -video [VideoPath] [optional:DetectEvery] [optional:OutputPath]\n";
+			return -1;
+		}
+		VideoOptions options;
+		options.source = argv[3];
+		if (argc >= 5)
+			options.detectEvery = std::stoi(argv[4]);
+		if (argc >= 6)
+			options.outputPath = argv[5];
+		return runVideo(data_set, options);
+	}
+
 	std::string imgPath;
 	if (argc >= 3)
 	{
@@ -70,21 +151,183 @@ int main(int argc, char** argv)
 }
 
 
-EyePos loadEP(const std::string& filename)
+std::string csvQuote(const std::string& str)
+{
+	std::string res = "\"";
+	for (char c : str)
+	{
+		if (c == '"')
+			res += '"';
+		res += c;
+	}
+	return res + "\"";
+}
+
+int runBatch(const TrainDataSet& data_set, const std::string& listPath, const std::string& outPath, int k)
+{
+	std::vector<std::string> probes;
+	if (!readProbeList(listPath, probes))
+		return -1;
+
+	std::fstream out(outPath, std::ios::out);
+	if (!out.is_open())
+	{
+		std::cout << "Cannot open output " + outPath << std::endl;
+		return -1;
+	}
+	bool json = outPath.size() >= 5 && outPath.substr(outPath.size() - 5) == ".json";
+	if (json)
+		out << "[";
+	else
+		out << "probe,valid,rank,index,name,identity,dist\n";
+
+	int done = 0, failed = 0;
+	for (int begin = 0; begin < probes.size(); begin += BatchSize)
+	{
+		int end = std::min(begin + BatchSize, static_cast<int>(probes.size()));
+
+		std::vector<DataObject> objs = loadProbes(probes, begin, end);
+		auto results = data_set.recognizeBatch(objs, true, k);
+
+		for (auto& res : results)
+		{
+			if (!res.valid)
+				failed++;
+			if (json)
+			{
+				out << (done == 0 ? "\n" : ",\n");
+				out << "  " << resultToJson(data_set, res);
+			}
+			else
+			{
+				if (!res.valid)
+					out << csvQuote(res.filename) << ",0,,,,,\n";
+				for (int i = 0; i < res.matches.size(); ++i)
+				{
+					auto& m = res.matches[i];
+					out << csvQuote(res.filename) << ",1," << i + 1 << "," << m.index << ","
+						<< csvQuote(data_set.getImageName(m.index)) << "," << csvQuote(data_set.getIdentity(m.index)) << "," << m.dist << "\n";
+				}
+			}
+			done++;
+		}
+		std::cout << "Recognized " << done << " of " << probes.size() << " probes\n";
+	}
+	if (json)
+		out << "\n]\n";
+	out.close();
+
+	std::cout << done << " probes recognized, " << failed << " without a face, results written to " + outPath << std::endl;
+	return 0;
+}
+
+int runCompare(const std::string& modelPath, const std::string& listPath, const std::string& precisionName)
+{
+	Precision precision;
+	if (precisionName == "fp16")
+		precision = Precision::FP16;
+	else if (precisionName == "int8")
+		precision = Precision::INT8;
+	else
+	{
+		std::cout << "Unknown precision " + precisionName << ", should be fp16 or int8\n";
+		return -1;
+	}
+
+	std::vector<std::string> probes;
+	if (!readProbeList(listPath, probes))
+		return -1;
+
+	TrainDataSet reference, reduced;
+	reference.loadModel(modelPath);
+	if (reference.getPrecision() != Precision::FP32)
+	{
+		std::cout << "The model is saved in reduced precision, compare with a fp32 model instead.\n";
+		return -1;
+	}
+	reduced.loadModel(modelPath);
+	reduced.setPrecision(precision);
+
+	constexpr int k = 5;
+	int valid = 0, top1Same = 0, overlap = 0;
+	// probes with a match of their own identity in the first 1 and k matches, fp32 and reduced
+	int expectedTop1 = 0, expectedTopK = 0, actualTop1 = 0, actualTopK = 0;
+	double distDelta = 0;
+	for (int begin = 0; begin < probes.size(); begin += BatchSize)
+	{
+		int end = std::min(begin + BatchSize, static_cast<int>(probes.size()));
+		std::vector<DataObject> objs = loadProbes(probes, begin, end);
+		auto expected = reference.recognizeBatch(objs, true, k);
+		auto actual = reduced.recognizeBatch(objs, true, k);
+
+		// a probe scores top-1 when the first match has its identity, top-k when any match has
+		auto score = [&reference](const std::vector<Match>& matches, const std::string& identity, int& top1, int& topK)
+		{
+			if (matches.empty())
+				return;
+			if (reference.getIdentity(matches[0].index) == identity)
+				top1++;
+			if (std::any_of(matches.begin(), matches.end(), [&](const Match& m) { return reference.getIdentity(m.index) == identity; }))
+				topK++;
+		};
+
+		for (int i = 0; i < expected.size(); ++i)
+		{
+			if (!expected[i].valid || expected[i].matches.empty())
+				continue;
+			valid++;
+			auto& e = expected[i].matches;
+			auto& a = actual[i].matches;
+			std::string identity = ImageReader::parseIdentity(std::filesystem::path(objs[i].filename).replace_extension().string());
+			score(e, identity, expectedTop1, expectedTopK);
+			if (actual[i].valid)
+				score(a, identity, actualTop1, actualTopK);
+			if (a.empty())
+				continue;
+			if (a.at(0).index == e.at(0).index)
+				top1Same++;
+			for (auto& m : a)
+				if (std::any_of(e.begin(), e.end(), [&m](const Match& x) { return x.index == m.index; }))
+					overlap++;
+			distDelta += std::abs(a.at(0).dist - e.at(0).dist) / std::max(e.at(0).dist, 1e-6);
+		}
+	}
+
+	if (valid == 0)
+	{
+		std::cout << "No face found in any probe.\n";
+		return -1;
+	}
+	std::cout << "Eigen faces: " << reference.basisBytes() << " bytes in fp32, " << reduced.basisBytes() << " bytes in " + precisionName << std::endl;
+	std::cout << valid << " probes recognized\n";
+	auto percent = [valid](int count) { return 100.0 * count / valid; };
+	std::cout << "Top-1 accuracy: " << percent(expectedTop1) << "% in fp32, " << percent(actualTop1) << "% in " + precisionName
+		<< ", delta " << percent(actualTop1) - percent(expectedTop1) << "%\n";
+	std::cout << "Top-" << k << " accuracy: " << percent(expectedTopK) << "% in fp32, " << percent(actualTopK) << "% in " + precisionName
+		<< ", delta " << percent(actualTopK) - percent(expectedTopK) << "%\n";
+	std::cout << "Top-1 agreement with fp32: " << 100.0 * top1Same / valid << "%\n";
+	std::cout << "Top-" << k << " overlap with fp32: " << 100.0 * overlap / (static_cast<double>(valid) * k) << "%\n";
+	std::cout << "Mean relative top-1 dist delta: " << distDelta / valid << std::endl;
+	return 0;
+}
+
+int runServe(const std::string& modelPath, const ServerOptions& options)
 {
-	std::fstream eps(filename, std::ios::in);
-	if (!eps.is_open())
-		return InvalidEyePos;
-	EyePos ep;
-	std::string temp;
-
-	// .eye format:
-	// #LX 	LY	RX	RY
-	// 232 	110	161	110
-	std::getline(eps, temp);
-	eps >> ep.RightX >> ep.RightY >> ep.LeftX >> ep.LeftY;
-
-	eps.close();
-
-	return ep;
-}
\ No newline at end of file
+	std::string mappedPath = modelPath + "model.bin";
+	// a model.bin older than model.xml is from a previous training, serving it would hide the new one
+	std::error_code binError, xmlError;
+	auto binTime = std::filesystem::last_write_time(mappedPath, binError);
+	auto xmlTime = std::filesystem::last_write_time(modelPath + "model.xml", xmlError);
+	// one written by another version cannot be mapped at all
+	MappedModelHeader header = {};
+	std::fstream(mappedPath, std::ios::in | std::ios::binary).read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (binError || (!xmlError && xmlTime > binTime) || header.version != MappedModelVersion)
+	{
+		std::cout << "Exporting " + mappedPath + " from model.xml\n";
+		TrainDataSet data_set;
+		data_set.loadModel(modelPath);
+		if (!data_set.exportMappedModel(mappedPath))
+			return -1;
+	}
+	return runServer(mappedPath, options);
+}
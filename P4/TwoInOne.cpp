@@ -4,7 +4,12 @@
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/calib3d.hpp>
-#include "reader.h"
+#include "image_source.h"
+#include "chessboard.h"
+#include "camera_profile.h"
+#include "birdseye.h"
+#include "calib_cache.h"
+#include "sparse_calib.h"
 
 using std::vector;
 using std::cout;
@@ -14,13 +19,16 @@ using std::endl;
 
 int main(int argc, char* argv[]) {
 
-	if (argc != 5) {
+	if (argc < 5 || argc > 7) {
 		cout << "Error: Unexpected number of input parameters\n";
-		cout << "Usage: " << argv[0] << " [ImageDirectory] [WidthCornerCount] [HeightCornerCount] [BirdsviewImagePath]\n";
+		cout << "Usage: " << argv[0] << " [ImageDirectory] [WidthCornerCount] [HeightCornerCount] [BirdsviewImagePath] [optional:MaxViews] [optional:Solver]\n";
 		cout << "ImageDirectory: Directory of images, end with \\\n";
 		cout << "WidthCornerCount: The number of corners in one row\n";
 		cout << "HeightCornerCount: The number of corners in one col\n";
 		cout << "BirdsviewImagePath: The path of the source image to generate bird's view\n";
+		cout << "MaxViews(default 40): The number of views with the most diverse board poses used to calibrate, all views when 0\n";
+		cout << "Solver(default dense): dense for calibrateCamera, sparse for the Schur complement solver that scales to many views\n";
+		cout << "The calibration is cached in ImageDirectory by the hash of the images and the board, later runs with the same inputs skip it\n";
 		return -1;
 	}
 
@@ -28,57 +36,88 @@ int main(int argc, char* argv[]) {
 	int widthCorner = std::stoi(argv[2]),
 		heightCorner = std::stoi(argv[3]);
 	std::string imagePath(argv[4]);
-
-	cout << "Loading images...\n";
-	vector<cv::Mat> images = loadImages(imageDir);
-
-	// rotate to the same direction
-	for (auto& image : images)
-	{
-		if (image.rows > image.cols)
-			cv::rotate(image, image, cv::ROTATE_90_CLOCKWISE);
-	}
+	int maxViews = argc >= 6 ? std::stoi(argv[5]) : 40;
+	bool sparse = argc >= 7 && std::string(argv[6]) == "sparse";
 
 	cv::Size cornerSize(widthCorner, heightCorner);
 
-	// Collection of corner position for every image
-	vector<vector<cv::Point2f>> imagePoints;
-	// Collection of corner coordinates for every image in object coordinate system
-	vector<vector<cv::Point3f>> objectPoints;
+	// the calibration depends on the images, the board and the views kept only
+	uint64_t calibHash = FnvOffset;
+	for (auto& file : listImages(imageDir))
+		calibHash = hashFile(file, calibHash);
+	int calibParams[4] = { widthCorner, heightCorner, maxViews, sparse };
+	calibHash = fnv1a(calibParams, sizeof(calibParams), calibHash);
+	std::string cachePath = imageDir + "calibration_" + hashToString(calibHash) + ".xml";
 
-	cout << "Searching corners...\n";
-	for (auto& image : images)
+	CalibrationCache cache;
+	if (loadCalibrationCache(cachePath, cache))
 	{
-		cv::Mat grayImage;
-		cv::cvtColor(image, grayImage, cv::COLOR_BGR2GRAY);
-
-		vector<cv::Point2f> corners;
-		bool patternWasFound = cv::findChessboardCorners(grayImage, cornerSize, corners);
-		imagePoints.push_back(corners);
+		cout << "Using the calibration cached in " << cachePath << ", reprojection error was " << cache.error << endl;
+	}
+	else
+	{
+		cache = CalibrationCache();
+		vector<std::string> files = listImages(imageDir);
+		if (files.empty())
+		{
+			cout << "Cannot find any image in " + imageDir << endl;
+			return -1;
+		}
 
-		if (patternWasFound)
+		// gray images are decoded ahead in windows and searched while the next window decodes, only the corners are kept
+		cout << "Searching corners...\n";
+		ImageSourceOptions options;
+		options.grayscale = true;
+		options.landscape = true;
+		ImageSource source(files, options);
+		vector<BoardView> views;
+		vector<cv::Mat> batch;
+		vector<int> indices;
+		cv::Size imageSize;
+		while (source.nextBatch(batch, indices, options.prefetch))
 		{
-			vector<cv::Point3f> opts;
-			int boardsNum = widthCorner * heightCorner;
-			opts.resize(boardsNum);
-			for (int i = 0; i < boardsNum; i++)
+			if (imageSize.area() == 0)
+				imageSize = batch[0].size();
+			for (auto& view : findBoardViews(batch, cornerSize))
 			{
-				opts[i] = cv::Point3f(static_cast<float>(i / widthCorner),
-					static_cast<float>(i % widthCorner), 0.0f);
+				if (batch[view.index].size() != imageSize)
+					continue;
+				view.index = indices[view.index];
+				views.push_back(std::move(view));
 			}
-			objectPoints.push_back(opts);
 		}
-	}
-	cout << "Calibrating..." << endl;
+		cout << "Board found in " << views.size() << " of " << files.size() << " images\n";
+		if (views.empty())
+		{
+			cout << "Error: Couldn't find the checkerboard in any image\n";
+			return -1;
+		}
+		views = selectDiverseViews(views, cornerSize, imageSize, maxViews);
+
+		// Collection of corner position for every image
+		vector<vector<cv::Point2f>> imagePoints;
+		// Collection of corner coordinates for every image in object coordinate system
+		vector<vector<cv::Point3f>> objectPoints;
+		for (auto& view : views)
+		{
+			imagePoints.push_back(view.corners);
+			objectPoints.push_back(boardObjectPoints(cornerSize));
+		}
+		cout << "Calibrating with " << views.size() << " views..." << endl;
 
 
-	cv::Mat cameraMatrix, distCoeffs;
-	double err = cv::calibrateCamera(objectPoints, imagePoints, images[0].size(),
-		cameraMatrix, distCoeffs, cv::noArray(), cv::noArray(),
-		cv::CALIB_ZERO_TANGENT_DIST | cv::CALIB_FIX_PRINCIPAL_POINT);
+		int flags = cv::CALIB_ZERO_TANGENT_DIST | cv::CALIB_FIX_PRINCIPAL_POINT;
+		double err = sparse ? calibrateCameraSparse(objectPoints, imagePoints, imageSize, cache.cameraMatrix, cache.distCoeffs, flags)
+			: cv::calibrateCamera(objectPoints, imagePoints, imageSize,
+				cache.cameraMatrix, cache.distCoeffs, cv::noArray(), cv::noArray(), flags);
 
-	// save result
-	cout << "Reprojection error is " << err << endl;
+		// save result
+		cout << "Reprojection error is " << err << endl;
+		cache.imageSize = imageSize;
+		cache.error = err;
+		if (!saveCalibrationCache(cachePath, cache))
+			cout << "Cannot write the calibration cache " << cachePath << endl;
+	}
 
 	cv::Mat imageSrc = cv::imread(imagePath);
 	if (imageSrc.empty()) {
@@ -88,22 +127,26 @@ int main(int argc, char* argv[]) {
 
 	// remap
 	cv::Mat image;
-	cv::undistort(imageSrc, image, cameraMatrix, distCoeffs, cameraMatrix);
+	CameraProfile profile(cache.cameraMatrix, cache.distCoeffs, cache.imageSize);
+	profile.undistort(imageSrc, image);
 	cv::Mat gray;
 	cv::cvtColor(image, gray, cv::COLOR_BGRA2GRAY);
 
+	// the corners of the same view image are cached with the calibration
+	uint64_t viewHash = hashFile(imagePath);
+	bool cachedView = cache.viewHash == viewHash && static_cast<int>(cache.corners.size()) == cornerSize.area();
 	vector<cv::Point2f> corners;
-	bool found = cv::findChessboardCorners(gray, cornerSize, corners, cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_FILTER_QUADS);
+	bool found = true;
+	if (cachedView)
+		corners = cache.corners;
+	else
+		found = findBoardCorners(gray, cornerSize, corners, cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_FILTER_QUADS);
 	if (!found) {
 		cout << "Error: Couldn't acquire checkerboard on " << imagePath << ", only found "
 			<< corners.size() << " of " << widthCorner * heightCorner << " corners\n";
 		return -1;
 	}
 
-	// Get Subpixel accuracy on those corners
-	cv::cornerSubPix(gray, corners, cv::Size(11, 11), cv::Size(-1, -1),
-		cv::TermCriteria(cv::TermCriteria::EPS | cv::TermCriteria::COUNT, 30, 0.1));
-
 	cv::Point2f imgPts[4];
 
 	// get the coordinates of four corner points of the corners on the checkerboard
@@ -126,30 +169,19 @@ int main(int argc, char* argv[]) {
 	cv::Point2f objPts[4];
 	cv::Mat homography;
 
+	BirdseyeView view(profile, imageSrc.size(), cornerSize, corners);
+
 	cout << "\nPress 's' for lower birdseye view, and 'w' for higher, Esc to exit" << endl;
-	double projectionSize = 15;
+	double projectionSize = cachedView && cache.projectionSize > 0 ? cache.projectionSize : 15;
 	cv::Mat birdseyeImage;
 	while (true) {
 
-		// left top
-		objPts[0].x = 100;
-		objPts[0].y = 100;
-		// right top
-		objPts[1].x = 100 + (widthCorner - 1) * projectionSize;
-		objPts[1].y = 100;
-		// left bottom
-		objPts[2].x = 100;
-		objPts[2].y = 100 + (heightCorner - 1) * projectionSize;
-		// right bottom
-		objPts[3].x = 100 + (widthCorner - 1) * projectionSize;
-		objPts[3].y = 100 + (heightCorner - 1) * projectionSize;
-
+		birdseyeObjectPoints(cornerSize, projectionSize, objPts);
 		// get the homography mat from object coordinate system to image coordinate system
-		homography = cv::getPerspectiveTransform(objPts, imgPts);
+		homography = view.homography(projectionSize);
 
-		cv::warpPerspective(image, birdseyeImage, homography, image.size(),
-			cv::WARP_INVERSE_MAP | cv::INTER_LINEAR, cv::BORDER_CONSTANT,
-			cv::Scalar::all(0));
+		// undistort and warp the source image in one pass
+		view.warp(imageSrc, birdseyeImage, projectionSize);
 		cv::imshow("BirdsEye", birdseyeImage);
 		int key = cv::waitKey() & 255;
 		if (key == 'w')
@@ -171,7 +203,7 @@ int main(int argc, char* argv[]) {
 	cv::Mat rvec, tvec, rmat;
 	cv::solvePnP(object_points, 	// 3-d points in object coordinate
 		image_points,  	// 2-d points in image coordinates
-		cameraMatrix,     	// Our camera matrix
+		profile.scaledCameraMatrix(image.size()),     	// Our camera matrix
 		cv::Mat(),     	// Since we corrected distortion in the
 						 // beginning,now we have zero distortion
 						 // coefficients
@@ -186,5 +218,19 @@ int main(int argc, char* argv[]) {
 	cout << "homography matrix: " << homography << endl;
 	cout << "inverted homography matrix: " << homography.inv() << endl;
 
+	cache.viewHash = viewHash;
+	cache.corners = corners;
+	cache.projectionSize = projectionSize;
+	cache.homography = homography;
+	cache.rvec = rvec;
+	cache.tvec = tvec;
+	if (!saveCalibrationCache(cachePath, cache))
+		cout << "Cannot write the calibration cache " << cachePath << endl;
+
+	// the chosen view is replayed on video by birdstream
+	BirdseyeSetup setup{ imageSrc.size(), projectionSize, homography };
+	if (saveBirdseyeSetup("birdseye.xml", setup))
+		cout << "Storing birdseye.xml for birdstream\n";
+
 	return 0;
 }
\ No newline at end of file
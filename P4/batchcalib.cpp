@@ -0,0 +1,249 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/calib3d.hpp>
+#include "chessboard.h"
+#include "camera_profile.h"
+#include "calib_cache.h"
+#include "image_source.h"
+#include "sparse_calib.h"
+
+using std::cout;
+using std::endl;
+using std::vector;
+
+
+struct CameraJob
+{
+	std::string name;
+	std::string dir;
+	cv::Size cornerSize;
+
+	vector<std::string> files;
+	// size of the first readable image, every image of a camera is expected to have it
+	cv::Size imageSize;
+	int found = 0;
+	int used = 0;
+	double error = -1;
+	cv::Mat cameraMatrix, distCoeffs;
+	std::string status = "ok";
+};
+
+// one image of one camera, the unit of the shared corner search
+struct ImageTask
+{
+	int camera;
+	int image;
+	cv::Size size;
+	bool found = false;
+	vector<cv::Point2f> corners;
+};
+
+/*
+ * Read "[ImageDirectory] [WidthCornerCount] [HeightCornerCount] [optional:Name]" lines, '#' starts a comment.
+ * The name defaults to the last directory of the path.
+ */
+bool readManifest(const std::string& path, vector<CameraJob>& cameras)
+{
+	std::ifstream in(path);
+	if (!in.is_open())
+		return false;
+
+	std::string line;
+	while (std::getline(in, line))
+	{
+		line = line.substr(0, line.find('#'));
+		std::stringstream ss(line);
+		CameraJob job;
+		if (!(ss >> job.dir >> job.cornerSize.width >> job.cornerSize.height))
+			continue;
+		if (!(ss >> job.name))
+		{
+			std::string trimmed = job.dir.substr(0, job.dir.find_last_not_of("/\\") + 1);
+			job.name = trimmed.substr(trimmed.find_last_of("/\\") + 1);
+		}
+		if (job.dir.back() != '/' && job.dir.back() != '\\')
+			job.dir += '/';
+		cameras.push_back(job);
+	}
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+
+	if (argc < 3 || argc > 6) {
+		cout << "Error: Unexpected number of input parameters\n";
+		cout << "Usage: " << argv[0] << " [Manifest] [OutputDirectory] [optional:MaxViews] [optional:SummaryPath] [optional:Solver]\n";
+		cout << "Manifest: One camera per line, \"[ImageDirectory] [WidthCornerCount] [HeightCornerCount] [optional:Name]\"\n";
+		cout << "OutputDirectory: Directory of the results, end with \\, every camera writes [Name]_intrinsics.xml\n";
+		cout << "MaxViews(default 40): The number of views with the most diverse board poses used to calibrate each camera, all views when 0\n";
+		cout << "SummaryPath(default OutputDirectory\\summary.csv, also when empty): The csv of the reprojection error of every camera\n";
+		cout << "Solver(default dense): dense for calibrateCamera, sparse for the Schur complement solver that scales to many views, the cameras are then solved one after another\n";
+		return -1;
+	}
+
+	std::string outDir(argv[2]);
+	int maxViews = argc >= 4 ? std::stoi(argv[3]) : 40;
+	std::string summaryPath = argc >= 5 && argv[4][0] != '\0' ? argv[4] : outDir + "summary.csv";
+	bool sparse = argc >= 6 && std::string(argv[5]) == "sparse";
+
+	vector<CameraJob> cameras;
+	if (!readManifest(argv[1], cameras) || cameras.empty()) {
+		cout << "Error: Couldn't read any camera from " << argv[1] << endl;
+		return -1;
+	}
+
+	// the images of all cameras in one list, so a camera with many images doesn't leave threads idle
+	vector<ImageTask> tasks;
+	for (int c = 0; c < cameras.size(); ++c)
+	{
+		cameras[c].files = listImages(cameras[c].dir);
+		if (cameras[c].files.empty())
+			cameras[c].status = "no images";
+		for (int i = 0; i < cameras[c].files.size(); ++i)
+		{
+			ImageTask task;
+			task.camera = c;
+			task.image = i;
+			tasks.push_back(task);
+		}
+	}
+
+	ImageSourceOptions options;
+	options.grayscale = true;
+	options.landscape = true;
+	cout << "Searching corners in " << tasks.size() << " images of " << cameras.size() << " cameras...\n";
+	int64 tick = cv::getTickCount();
+	cv::parallel_for_(cv::Range(0, static_cast<int>(tasks.size())), [&](const cv::Range& range)
+		{
+			for (int t = range.start; t < range.end; ++t)
+			{
+				ImageTask& task = tasks[t];
+				CameraJob& camera = cameras[task.camera];
+				// only the corners are kept, the image is dropped right after the search
+				cv::Mat gray = readImage(camera.files[task.image], options);
+				if (gray.empty())
+					continue;
+				task.size = gray.size();
+				task.found = findBoardCorners(gray, camera.cornerSize, task.corners);
+			}
+		}, static_cast<double>(tasks.size()));
+	cout << "Corner search took " << static_cast<double>(cv::getTickCount() - tick) / cv::getTickFrequency() << " s\n";
+
+	vector<vector<BoardView>> views(cameras.size());
+	for (auto& task : tasks)
+	{
+		CameraJob& camera = cameras[task.camera];
+		if (task.size.area() > 0 && camera.imageSize.area() == 0)
+			camera.imageSize = task.size;
+		if (task.found && task.size == camera.imageSize)
+			views[task.camera].push_back({ task.image, std::move(task.corners) });
+	}
+
+	// select the views of one camera and solve its intrinsics
+	auto calibrate = [&](int c)
+	{
+		CameraJob& camera = cameras[c];
+		camera.found = static_cast<int>(views[c].size());
+		if (camera.found == 0)
+		{
+			if (camera.status == "ok")
+				camera.status = "no board";
+			return;
+		}
+		vector<BoardView> selected = selectDiverseViews(views[c], camera.cornerSize, camera.imageSize, maxViews);
+		camera.used = static_cast<int>(selected.size());
+
+		vector<vector<cv::Point2f>> imagePoints;
+		vector<vector<cv::Point3f>> objectPoints;
+		for (auto& view : selected)
+		{
+			imagePoints.push_back(view.corners);
+			objectPoints.push_back(boardObjectPoints(camera.cornerSize));
+		}
+		try
+		{
+			int flags = cv::CALIB_ZERO_TANGENT_DIST | cv::CALIB_FIX_PRINCIPAL_POINT;
+			camera.error = sparse ? calibrateCameraSparse(objectPoints, imagePoints, camera.imageSize, camera.cameraMatrix, camera.distCoeffs, flags)
+				: cv::calibrateCamera(objectPoints, imagePoints, camera.imageSize,
+					camera.cameraMatrix, camera.distCoeffs, cv::noArray(), cv::noArray(), flags);
+		}
+		catch (const cv::Exception& e)
+		{
+			camera.status = "calibration failed";
+			camera.error = -1;
+			camera.cameraMatrix.release();
+			cout << "Calibration of " << camera.name << " failed: " << e.what() << endl;
+		}
+	};
+
+	cout << "Calibrating...\n";
+	tick = cv::getTickCount();
+	if (sparse)
+	{
+		// the sparse solver spreads the views of one camera over all threads itself, a parallel_for_ nested in
+		// the one over the cameras would run serially, so the cameras are solved one after another
+		for (int c = 0; c < cameras.size(); ++c)
+			calibrate(c);
+	}
+	else
+	{
+		// calibrateCamera runs on one thread, the solves are independent, one camera per task
+		cv::parallel_for_(cv::Range(0, static_cast<int>(cameras.size())), [&](const cv::Range& range)
+			{
+				for (int c = range.start; c < range.end; ++c)
+					calibrate(c);
+			}, static_cast<double>(cameras.size()));
+	}
+	cout << "Calibration took " << static_cast<double>(cv::getTickCount() - tick) / cv::getTickFrequency() << " s\n";
+
+	for (auto& camera : cameras)
+	{
+		if (camera.cameraMatrix.empty())
+			continue;
+		// the maps of a whole rig are large, they are built on first use instead
+		CameraProfile profile(camera.cameraMatrix, camera.distCoeffs, camera.imageSize);
+		std::string resPath = outDir + camera.name + "_intrinsics.xml";
+		if (!profile.save(resPath, false))
+			camera.status = "cannot write " + resPath;
+	}
+
+	cout << std::fixed << std::setprecision(4);
+	cout << "\n" << std::left << std::setw(16) << "camera" << std::right << std::setw(8) << "images" << std::setw(8) << "found"
+		<< std::setw(8) << "used" << std::setw(10) << "error" << "  status\n";
+	for (auto& camera : cameras)
+	{
+		cout << std::left << std::setw(16) << camera.name << std::right << std::setw(8) << camera.files.size() << std::setw(8) << camera.found
+			<< std::setw(8) << camera.used << std::setw(10) << camera.error << "  " << camera.status << "\n";
+	}
+
+	std::fstream csv(summaryPath, std::ios::out);
+	if (!csv.is_open()) {
+		cout << "Cannot open output " << summaryPath << endl;
+		return -1;
+	}
+	csv << "camera,directory,board_width,board_height,images,found,used,image_width,image_height,reprojection_error,fx,fy,cx,cy,status\n";
+	for (auto& camera : cameras)
+	{
+		csv << camera.name << "," << camera.dir << "," << camera.cornerSize.width << "," << camera.cornerSize.height << ","
+			<< camera.files.size() << "," << camera.found << "," << camera.used << ","
+			<< camera.imageSize.width << "," << camera.imageSize.height << "," << camera.error;
+		if (camera.cameraMatrix.empty())
+			csv << ",,,,";
+		else
+			csv << "," << camera.cameraMatrix.at<double>(0, 0) << "," << camera.cameraMatrix.at<double>(1, 1)
+				<< "," << camera.cameraMatrix.at<double>(0, 2) << "," << camera.cameraMatrix.at<double>(1, 2);
+		csv << "," << camera.status << "\n";
+	}
+	csv.close();
+
+	bool failed = false;
+	for (auto& camera : cameras)
+		failed |= camera.status != "ok";
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+#include "birdseye.h"
+#include <opencv2/imgproc.hpp>
+#include <opencv2/calib3d.hpp>
+
+
+void birdseyeObjectPoints(cv::Size cornerSize, double projectionSize, cv::Point2f objPts[4])
+{
+	float right = static_cast<float>(100 + (cornerSize.width - 1) * projectionSize);
+	float bottom = static_cast<float>(100 + (cornerSize.height - 1) * projectionSize);
+	// left top
+	objPts[0] = cv::Point2f(100, 100);
+	// right top
+	objPts[1] = cv::Point2f(right, 100);
+	// left bottom
+	objPts[2] = cv::Point2f(100, bottom);
+	// right bottom
+	objPts[3] = cv::Point2f(right, bottom);
+}
+
+void birdseyeMaps(const CameraProfile& profile, cv::Size imageSize, const cv::Mat& homography, cv::Mat& map1, cv::Mat& map2)
+{
+	// initUndistortRectifyMap sends a view pixel p to the normalized ray (K R)^-1 p before distorting it,
+	// with R = K^-1 H^-1 K that ray is K^-1 H p, the undistorted pixel H p seen through the lens
+	cv::Mat camera = profile.scaledCameraMatrix(imageSize);
+	cv::Mat h;
+	homography.convertTo(h, CV_64F);
+	cv::Mat rectify = camera.inv() * h.inv() * camera;
+	cv::initUndistortRectifyMap(camera, profile.getDistCoeffs(), rectify, camera, imageSize, CV_16SC2, map1, map2);
+}
+
+bool saveBirdseyeSetup(const std::string& path, const BirdseyeSetup& setup)
+{
+	cv::FileStorage fs(path, cv::FileStorage::WRITE);
+	if (!fs.isOpened())
+		return false;
+	fs << "ImageWidth" << setup.imageSize.width << "ImageHeight" << setup.imageSize.height
+		<< "ProjectionSize" << setup.projectionSize << "Homography" << setup.homography;
+	fs.release();
+	return true;
+}
+
+bool loadBirdseyeSetup(const std::string& path, BirdseyeSetup& setup)
+{
+	cv::FileStorage fs(path, cv::FileStorage::READ);
+	if (!fs.isOpened())
+		return false;
+	fs["ImageWidth"] >> setup.imageSize.width;
+	fs["ImageHeight"] >> setup.imageSize.height;
+	fs["ProjectionSize"] >> setup.projectionSize;
+	fs["Homography"] >> setup.homography;
+	fs.release();
+	return !setup.homography.empty() && setup.imageSize.area() > 0;
+}
+
+BirdseyeView::BirdseyeView(CameraProfile& profile, cv::Size imageSize, cv::Size cornerSize, const std::vector<cv::Point2f>& corners, size_t capacity)
+	: profile(profile), imageSize(imageSize), cornerSize(cornerSize), capacity(capacity < 1 ? 1 : capacity)
+{
+	imgPts[0] = corners[0];
+	imgPts[1] = corners[cornerSize.width - 1];
+	imgPts[2] = corners[(cornerSize.height - 1) * cornerSize.width];
+	imgPts[3] = corners[(cornerSize.height - 1) * cornerSize.width + cornerSize.width - 1];
+}
+
+const BirdseyeView::Entry& BirdseyeView::getEntry(double projectionSize)
+{
+	for (auto it = entries.begin(); it != entries.end(); ++it)
+	{
+		if (it->projectionSize == projectionSize)
+		{
+			entries.splice(entries.begin(), entries, it);
+			return entries.front();
+		}
+	}
+
+	Entry entry;
+	entry.projectionSize = projectionSize;
+	cv::Point2f objPts[4];
+	birdseyeObjectPoints(cornerSize, projectionSize, objPts);
+	entry.homography = cv::getPerspectiveTransform(objPts, imgPts);
+
+	birdseyeMaps(profile, imageSize, entry.homography, entry.map1, entry.map2);
+
+	entries.push_front(entry);
+	if (entries.size() > capacity)
+		entries.pop_back();
+	return entries.front();
+}
+
+cv::Mat BirdseyeView::homography(double projectionSize)
+{
+	return getEntry(projectionSize).homography;
+}
+
+void BirdseyeView::warp(const cv::Mat& src, cv::Mat& dst, double projectionSize)
+{
+	const Entry& entry = getEntry(projectionSize);
+	cv::remap(src, dst, entry.map1, entry.map2, cv::INTER_LINEAR);
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <list>
+#include <string>
+#include <vector>
+#include "camera_profile.h"
+
+
+/*
+ * Bird's eye view of a distorted camera image in one remap.
+ * The inverse homography and the distortion model are composed into a single table per projection size,
+ * the most recently used tables are kept.
+ */
+class BirdseyeView
+{
+	CameraProfile& profile;
+	// size of the distorted source images, also the size of the view
+	cv::Size imageSize;
+	cv::Size cornerSize;
+	// left top, right top, left bottom and right bottom corner of the board in the undistorted image
+	cv::Point2f imgPts[4];
+	size_t capacity;
+
+	struct Entry
+	{
+		double projectionSize;
+		cv::Mat homography;
+		cv::Mat map1, map2;
+	};
+	// front is the most recently used
+	std::list<Entry> entries;
+
+	const Entry& getEntry(double projectionSize);
+public:
+	/*
+	 * @param corners all corners of the board found in the undistorted image
+	 * @param capacity the number of tables kept
+	 */
+	BirdseyeView(CameraProfile& profile, cv::Size imageSize, cv::Size cornerSize, const std::vector<cv::Point2f>& corners, size_t capacity = 8);
+
+	// homography from the view to the undistorted image, a board square is projectionSize pixels wide in the view
+	cv::Mat homography(double projectionSize);
+
+	// warp the distorted src straight to the view
+	void warp(const cv::Mat& src, cv::Mat& dst, double projectionSize);
+};
+
+// the board corners at the projection size in the view, in the order of BirdseyeView::imgPts
+void birdseyeObjectPoints(cv::Size cornerSize, double projectionSize, cv::Point2f objPts[4]);
+
+/*
+ * Remap table from the view straight to the distorted source image.
+ * @param homography from the view to the undistorted image
+ */
+void birdseyeMaps(const CameraProfile& profile, cv::Size imageSize, const cv::Mat& homography, cv::Mat& map1, cv::Mat& map2);
+
+// the view chosen interactively, replayed on every frame of a stream
+struct BirdseyeSetup
+{
+	cv::Size imageSize;
+	double projectionSize = 0;
+	cv::Mat homography;
+};
+
+bool saveBirdseyeSetup(const std::string& path, const BirdseyeSetup& setup);
+// @return false when the file misses the homography or the image size
+bool loadBirdseyeSetup(const std::string& path, BirdseyeSetup& setup);
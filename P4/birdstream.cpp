@@ -0,0 +1,203 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cctype>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/videoio.hpp>
+#include "BoundedQueue.h"
+#include "chessboard.h"
+#include "camera_profile.h"
+#include "birdseye.h"
+#include "image_source.h"
+
+using std::cout;
+using std::endl;
+using std::vector;
+
+
+// frames buffered between two stages, enough to absorb a slow frame without holding many full images
+constexpr int StageQueueSize = 4;
+
+// frames of a video file, a camera, or the jpg images of a directory in name order
+class FrameSource
+{
+	cv::VideoCapture capture;
+	vector<std::string> files;
+	size_t next = 0;
+	bool sequence = false;
+public:
+	bool open(const std::string& source)
+	{
+		if (!source.empty() && (source.back() == '\\' || source.back() == '/'))
+		{
+			sequence = true;
+			files = listImages(source);
+			return !files.empty();
+		}
+		if (!source.empty() && std::all_of(source.begin(), source.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)) != 0; }))
+			return capture.open(std::stoi(source));
+		return capture.open(source);
+	}
+
+	bool read(cv::Mat& frame)
+	{
+		if (!sequence)
+			return capture.read(frame);
+		while (next < files.size())
+		{
+			frame = cv::imread(files[next++]);
+			if (!frame.empty())
+				return true;
+			cout << "Cannot read image " << files[next - 1] << endl;
+		}
+		return false;
+	}
+
+	// 25 for image sequences and streams that don't tell
+	double fps()
+	{
+		double fps = sequence ? 0 : capture.get(cv::CAP_PROP_FPS);
+		return fps > 0 ? fps : 25;
+	}
+};
+
+// find the board on the first frame and fix the view at the projection size
+bool detectSetup(CameraProfile& profile, const cv::Mat& frame, cv::Size cornerSize, double projectionSize, BirdseyeSetup& setup)
+{
+	cv::Mat image, gray;
+	profile.undistort(frame, image);
+	cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+
+	vector<cv::Point2f> corners;
+	if (!findBoardCorners(gray, cornerSize, corners, cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_FILTER_QUADS))
+	{
+		cout << "Error: Couldn't acquire checkerboard on the first frame, only found "
+			<< corners.size() << " of " << cornerSize.area() << " corners\n";
+		return false;
+	}
+	BirdseyeView view(profile, frame.size(), cornerSize, corners, 1);
+	setup.imageSize = frame.size();
+	setup.projectionSize = projectionSize;
+	setup.homography = view.homography(projectionSize);
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+
+	if (argc != 5 && argc != 7 && argc != 8) {
+		cout << "Error: Unexpected number of input parameters\n";
+		cout << "Usage: " << argv[0] << " [CalibrationResult] [Source] [Output] [BirdseyeSetup] [optional:WidthCornerCount] [optional:HeightCornerCount] [optional:ProjectionSize]\n";
+		cout << "CalibrationResult: The path of the result xml file of calibration\n";
+		cout << "Source: A video file, the index of a camera, or a directory of images end with \\\n";
+		cout << "Output: The path of the output video\n";
+		cout << "BirdseyeSetup: The view stored by birdsview, written here when the corner counts are given\n";
+		cout << "WidthCornerCount, HeightCornerCount: Find the board on the first frame instead of reading the setup\n";
+		cout << "ProjectionSize(default 15): The side of a board square in the view when the board is found on the first frame\n";
+		return -1;
+	}
+
+	std::string resPath(argv[1]);
+	std::string source(argv[2]);
+	std::string outPath(argv[3]);
+	std::string setupPath(argv[4]);
+	bool detect = argc >= 7;
+
+	CameraProfile profile;
+	if (!profile.load(resPath)) {
+		cout << "Error: Couldn't load intrinsic parameters from " << resPath << endl;
+		return -1;
+	}
+
+	FrameSource frames;
+	cv::Mat first;
+	if (!frames.open(source) || !frames.read(first)) {
+		cout << "Error: Couldn't read frames from " << source << endl;
+		return -1;
+	}
+
+	BirdseyeSetup setup;
+	if (detect)
+	{
+		cv::Size cornerSize(std::stoi(argv[5]), std::stoi(argv[6]));
+		double projectionSize = argc == 8 ? std::stod(argv[7]) : 15;
+		if (!detectSetup(profile, first, cornerSize, projectionSize, setup))
+			return -1;
+		if (!saveBirdseyeSetup(setupPath, setup))
+			cout << "Cannot write " << setupPath << endl;
+	}
+	else if (!loadBirdseyeSetup(setupPath, setup)) {
+		cout << "Error: Couldn't load the bird's eye view from " << setupPath << endl;
+		return -1;
+	}
+	if (first.size() != setup.imageSize) {
+		cout << "Error: Frames are " << first.cols << "x" << first.rows << ", the view is set up for "
+			<< setup.imageSize.width << "x" << setup.imageSize.height << endl;
+		return -1;
+	}
+
+	// the only table of the stream, every frame is one remap
+	cv::Mat map1, map2;
+	birdseyeMaps(profile, setup.imageSize, setup.homography, map1, map2);
+
+	cv::VideoWriter writer(outPath, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), frames.fps(), setup.imageSize);
+	if (!writer.isOpened()) {
+		cout << "Error: Couldn't open output " << outPath << endl;
+		return -1;
+	}
+
+	// decode -> warp -> encode, each stage on its own thread
+	BoundedQueue<cv::Mat> decoded(StageQueueSize), warped(StageQueueSize);
+	int skipped = 0;
+
+	std::thread reader([&]()
+		{
+			cv::Mat frame = first;
+			do
+			{
+				if (frame.size() != setup.imageSize)
+				{
+					skipped++;
+					continue;
+				}
+				if (!decoded.push(frame))
+					break;
+				// a new Mat, the queued one is still in use
+				frame = cv::Mat();
+			} while (frames.read(frame));
+			decoded.close();
+		});
+
+	std::thread warper([&]()
+		{
+			cv::Mat frame;
+			while (decoded.pop(frame))
+			{
+				cv::Mat view;
+				cv::remap(frame, view, map1, map2, cv::INTER_LINEAR);
+				if (!warped.push(view))
+					break;
+			}
+			warped.close();
+		});
+
+	int64 tick = cv::getTickCount();
+	int written = 0;
+	cv::Mat view;
+	while (warped.pop(view))
+	{
+		writer.write(view);
+		written++;
+	}
+	reader.join();
+	warper.join();
+	writer.release();
+
+	double seconds = static_cast<double>(cv::getTickCount() - tick) / cv::getTickFrequency();
+	cout << "Wrote " << written << " frames to " << outPath << ", " << (seconds > 0 ? written / seconds : 0) << " fps\n";
+	if (skipped > 0)
+		cout << skipped << " frames of another size were skipped\n";
+	return 0;
+}
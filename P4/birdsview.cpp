@@ -2,6 +2,9 @@
 #include <opencv2/calib3d.hpp>
 #include <opencv2/highgui.hpp>
 #include <iostream>
+#include "chessboard.h"
+#include "camera_profile.h"
+#include "birdseye.h"
 
 using std::cout;
 using std::endl;
@@ -25,17 +28,11 @@ int main(int argc, char* argv[]) {
 		heightCorner = std::stoi(argv[3]);
 	std::string resPath(argv[4]);
 
-	cv::FileStorage fs(resPath, cv::FileStorage::READ);
-	cv::Mat intrinsic, distortion;
-
-	fs["CameraMatrix"] >> intrinsic;
-	fs["DistortionCoefficients"] >> distortion;
-
-	if (!fs.isOpened() || intrinsic.empty() || distortion.empty()) {
+	CameraProfile profile;
+	if (!profile.load(resPath)) {
 		cout << "Error: Couldn't load intrinsic parameters from " << resPath << endl;
 		return -1;
 	}
-	fs.release();
 
 	cv::Mat imageSrc = cv::imread(imagePath);
 	if (imageSrc.empty()) {
@@ -45,24 +42,21 @@ int main(int argc, char* argv[]) {
 
 	// remap
 	cv::Mat image;
-	cv::undistort(imageSrc, image, intrinsic, distortion, intrinsic);
+	profile.undistort(imageSrc, image);
+	cv::Mat intrinsic = profile.scaledCameraMatrix(image.size());
 	cv::Mat gray;
 	cv::cvtColor(image, gray, cv::COLOR_BGRA2GRAY);
 
 	cv::Size cornerSize(widthCorner, heightCorner);
 
 	vector<cv::Point2f> corners;
-	bool found = cv::findChessboardCorners(gray, cornerSize, corners, cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_FILTER_QUADS);
+	bool found = findBoardCorners(gray, cornerSize, corners, cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_FILTER_QUADS);
 	if (!found) {
 		cout << "Error: Couldn't acquire checkerboard on " << imagePath << ", only found "
 			<< corners.size() << " of " << widthCorner * heightCorner << " corners\n";
 		return -1;
 	}
 
-	// Get Subpixel accuracy on those corners
-	cv::cornerSubPix(gray, corners, cv::Size(11, 11), cv::Size(-1, -1),
-		cv::TermCriteria(cv::TermCriteria::EPS | cv::TermCriteria::COUNT, 30, 0.1));
-
 	cv::Point2f imgPts[4];
 
 	// get the coordinates of four corner points of the corners on the checkerboard
@@ -85,30 +79,19 @@ int main(int argc, char* argv[]) {
 	cv::Point2f objPts[4];
 	cv::Mat homography;
 
+	BirdseyeView view(profile, imageSrc.size(), cornerSize, corners);
+
 	cout << "\nPress 's' for lower birdseye view, and 'w' for higher, Esc to exit" << endl;
 	double projectionSize = 15;
 	cv::Mat birdseyeImage;
 	while (true) {
 
-		// left top
-		objPts[0].x = 100;
-		objPts[0].y = 100;
-		// right top
-		objPts[1].x = 100 + (widthCorner - 1) * projectionSize;
-		objPts[1].y = 100;
-		// left bottom
-		objPts[2].x = 100;
-		objPts[2].y = 100 + (heightCorner - 1) * projectionSize;
-		// right bottom
-		objPts[3].x = 100 + (widthCorner - 1) * projectionSize;
-		objPts[3].y = 100 + (heightCorner - 1) * projectionSize;
-
+		birdseyeObjectPoints(cornerSize, projectionSize, objPts);
 		// get the homography mat from object coordinate system to image coordinate system
-		homography = cv::getPerspectiveTransform(objPts, imgPts);
+		homography = view.homography(projectionSize);
 
-		cv::warpPerspective(image, birdseyeImage, homography, image.size(),
-			cv::WARP_INVERSE_MAP | cv::INTER_LINEAR, cv::BORDER_CONSTANT,
-			cv::Scalar::all(0));
+		// undistort and warp the source image in one pass
+		view.warp(imageSrc, birdseyeImage, projectionSize);
 		cv::imshow("BirdsEye", birdseyeImage);
 		int key = cv::waitKey() & 255;
 		if (key == 'w')
@@ -145,5 +128,10 @@ int main(int argc, char* argv[]) {
 	cout << "homography matrix: " << homography << endl;
 	cout << "inverted homography matrix: " << homography.inv() << endl;
 
+	// the chosen view is replayed on video by birdstream
+	BirdseyeSetup setup{ imageSrc.size(), projectionSize, homography };
+	if (saveBirdseyeSetup("birdseye.xml", setup))
+		cout << "Storing birdseye.xml for birdstream\n";
+
 	return 0;
 }
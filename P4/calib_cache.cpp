@@ -0,0 +1,214 @@
+#include "calib_cache.h"
+#include "image_source.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+
+constexpr uint64_t FnvPrime = 1099511628211ULL;
+// bytes of a file hashed per read
+constexpr size_t HashChunk = 1 << 20;
+
+uint64_t fnv1a(const void* data, size_t size, uint64_t seed)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	uint64_t hash = seed;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= FnvPrime;
+	}
+	return hash;
+}
+
+uint64_t hashFile(const std::string& path, uint64_t seed)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in.is_open())
+		return seed;
+
+	// the name too, so renaming an image changes the set
+	std::string name = path.substr(path.find_last_of("/\\") + 1);
+	uint64_t hash = fnv1a(name.data(), name.size(), seed);
+	std::vector<char> buffer(HashChunk);
+	while (in)
+	{
+		in.read(buffer.data(), buffer.size());
+		hash = fnv1a(buffer.data(), static_cast<size_t>(in.gcount()), hash);
+	}
+	return hash;
+}
+
+std::string hashToString(uint64_t hash)
+{
+	std::stringstream ss;
+	ss << std::hex << std::setw(16) << std::setfill('0') << hash;
+	return ss.str();
+}
+
+bool loadCalibrationCache(const std::string& path, CalibrationCache& cache)
+{
+	cv::FileStorage fs(path, cv::FileStorage::READ);
+	if (!fs.isOpened())
+		return false;
+
+	fs["ImageWidth"] >> cache.imageSize.width;
+	fs["ImageHeight"] >> cache.imageSize.height;
+	fs["CameraMatrix"] >> cache.cameraMatrix;
+	fs["DistortionCoefficients"] >> cache.distCoeffs;
+	fs["ReprojectionError"] >> cache.error;
+
+	// FileStorage has no 64 bit integers
+	std::string viewHash;
+	fs["ViewHash"] >> viewHash;
+	cache.viewHash = viewHash.empty() ? 0 : std::stoull(viewHash, nullptr, 16);
+	fs["Corners"] >> cache.corners;
+	fs["ProjectionSize"] >> cache.projectionSize;
+	fs["Homography"] >> cache.homography;
+	fs["Rvec"] >> cache.rvec;
+	fs["Tvec"] >> cache.tvec;
+	fs.release();
+
+	if (cache.corners.empty() || cache.homography.empty())
+		cache.viewHash = 0;
+	return !cache.cameraMatrix.empty() && !cache.distCoeffs.empty() && cache.imageSize.area() > 0;
+}
+
+bool saveCalibrationCache(const std::string& path, const CalibrationCache& cache)
+{
+	cv::FileStorage fs(path, cv::FileStorage::WRITE);
+	if (!fs.isOpened())
+		return false;
+
+	fs << "ImageWidth" << cache.imageSize.width << "ImageHeight" << cache.imageSize.height
+		<< "CameraMatrix" << cache.cameraMatrix << "DistortionCoefficients" << cache.distCoeffs
+		<< "ReprojectionError" << cache.error;
+	if (cache.viewHash != 0)
+	{
+		fs << "ViewHash" << hashToString(cache.viewHash) << "Corners" << cache.corners
+			<< "ProjectionSize" << cache.projectionSize << "Homography" << cache.homography
+			<< "Rvec" << cache.rvec << "Tvec" << cache.tvec;
+	}
+	fs.release();
+	return true;
+}
+
+std::string CornerCache::defaultPath(const std::string& dir, cv::Size cornerSize)
+{
+	return dir + "corners_" + std::to_string(cornerSize.width) + "x" + std::to_string(cornerSize.height) + ".xml";
+}
+
+bool CornerCache::load(const std::string& path)
+{
+	records.clear();
+	cv::FileStorage fs(path, cv::FileStorage::READ);
+	if (!fs.isOpened())
+		return false;
+
+	int width = 0, height = 0;
+	fs["BoardWidth"] >> width;
+	fs["BoardHeight"] >> height;
+	if (cv::Size(width, height) != cornerSize)
+		return false;
+
+	cv::FileNode views = fs["Views"];
+	for (auto it = views.begin(); it != views.end(); ++it)
+	{
+		cv::FileNode node = *it;
+		std::string hash;
+		CornerRecord record;
+		int found = 0;
+		node["Hash"] >> hash;
+		node["Found"] >> found;
+		node["ImageWidth"] >> record.imageSize.width;
+		node["ImageHeight"] >> record.imageSize.height;
+		node["Corners"] >> record.corners;
+		record.found = found != 0 && static_cast<int>(record.corners.size()) == cornerSize.area();
+		if (!hash.empty())
+			records[std::stoull(hash, nullptr, 16)] = record;
+	}
+	return true;
+}
+
+bool CornerCache::save(const std::string& path) const
+{
+	cv::FileStorage fs(path, cv::FileStorage::WRITE);
+	if (!fs.isOpened())
+		return false;
+
+	fs << "BoardWidth" << cornerSize.width << "BoardHeight" << cornerSize.height;
+	fs << "Views" << "[";
+	for (auto& record : records)
+	{
+		fs << "{" << "Hash" << hashToString(record.first) << "Found" << static_cast<int>(record.second.found)
+			<< "ImageWidth" << record.second.imageSize.width << "ImageHeight" << record.second.imageSize.height;
+		if (record.second.found)
+			fs << "Corners" << record.second.corners;
+		fs << "}";
+	}
+	fs << "]";
+	fs.release();
+	return true;
+}
+
+std::vector<BoardView> CornerCache::findViews(const std::vector<std::string>& files, cv::Size& imageSize, int& searched, std::vector<uint64_t>& viewHashes)
+{
+	int n = static_cast<int>(files.size());
+	std::vector<uint64_t> hashes(n);
+	cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& range)
+		{
+			for (int i = range.start; i < range.end; ++i)
+				hashes[i] = hashFile(files[i]);
+		});
+
+	std::vector<int> pending;
+	for (int i = 0; i < n; ++i)
+		if (records.find(hashes[i]) == records.end())
+			pending.push_back(i);
+
+	// only the new images are decoded
+	ImageSourceOptions options;
+	options.grayscale = true;
+	options.landscape = true;
+	std::vector<CornerRecord> found(pending.size());
+	cv::parallel_for_(cv::Range(0, static_cast<int>(pending.size())), [&](const cv::Range& range)
+		{
+			for (int p = range.start; p < range.end; ++p)
+			{
+				cv::Mat gray = readImage(files[pending[p]], options);
+				if (gray.empty())
+					continue;
+				found[p].imageSize = gray.size();
+				found[p].found = findBoardCorners(gray, cornerSize, found[p].corners);
+				if (!found[p].found)
+					found[p].corners.clear();
+			}
+		}, static_cast<double>(pending.size()));
+
+	searched = static_cast<int>(pending.size());
+	for (int p = 0; p < pending.size(); ++p)
+	{
+		// unreadable files are tried again next time
+		if (found[p].imageSize.area() == 0)
+			continue;
+		records[hashes[pending[p]]] = std::move(found[p]);
+	}
+
+	std::vector<BoardView> views;
+	viewHashes.clear();
+	imageSize = cv::Size();
+	for (int i = 0; i < n; ++i)
+	{
+		auto it = records.find(hashes[i]);
+		if (it == records.end() || !it->second.found)
+			continue;
+		if (imageSize.area() == 0)
+			imageSize = it->second.imageSize;
+		if (it->second.imageSize != imageSize)
+			continue;
+		viewHashes.push_back(hashes[i]);
+		views.push_back({ i, it->second.corners });
+	}
+	return views;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include "chessboard.h"
+
+
+constexpr uint64_t FnvOffset = 14695981039346656037ULL;
+
+// 64 bit FNV-1a of the bytes, chained by passing the previous hash as seed
+uint64_t fnv1a(const void* data, size_t size, uint64_t seed = FnvOffset);
+// hash of the name and the whole content of the file, the seed when it cannot be read
+uint64_t hashFile(const std::string& path, uint64_t seed = FnvOffset);
+// 16 hex digits
+std::string hashToString(uint64_t hash);
+
+/*
+ * Calibration of one image set and board, with the bird's eye view of one image.
+ * The extrinsics are valid only when viewHash matches the hash of that image.
+ */
+struct CalibrationCache
+{
+	cv::Size imageSize;
+	cv::Mat cameraMatrix, distCoeffs;
+	double error = 0;
+
+	uint64_t viewHash = 0;
+	// corners found in the undistorted view image
+	std::vector<cv::Point2f> corners;
+	double projectionSize = 0;
+	cv::Mat homography, rvec, tvec;
+};
+
+// @return false when the file is missing or has no intrinsics
+bool loadCalibrationCache(const std::string& path, CalibrationCache& cache);
+bool saveCalibrationCache(const std::string& path, const CalibrationCache& cache);
+
+// corners of one image, found or not, so the image is never searched again
+struct CornerRecord
+{
+	bool found = false;
+	// size after rotating to landscape
+	cv::Size imageSize;
+	std::vector<cv::Point2f> corners;
+};
+
+/*
+ * Corners of every image searched so far, keyed by hashFile of the image, for one board size.
+ * Stored in the image directory as corners_[Width]x[Height].xml.
+ */
+class CornerCache
+{
+	cv::Size cornerSize;
+	std::map<uint64_t, CornerRecord> records;
+public:
+	explicit CornerCache(cv::Size cornerSize) : cornerSize(cornerSize) {}
+
+	static std::string defaultPath(const std::string& dir, cv::Size cornerSize);
+	// @return false when there is no cache of the board size, the cache stays empty
+	bool load(const std::string& path);
+	bool save(const std::string& path) const;
+
+	/*
+	 * Views of the files where the board was found, searched on all threads for images not in the cache yet.
+	 * Views of another size than the first found one are dropped.
+	 * @param imageSize the size of the returned views
+	 * @param searched the number of images searched in this call
+	 * @param viewHashes hashFile of the image of every returned view
+	 */
+	std::vector<BoardView> findViews(const std::vector<std::string>& files, cv::Size& imageSize, int& searched, std::vector<uint64_t>& viewHashes);
+};
@@ -1,27 +1,74 @@
 // Example 18-1. Reading a chessboards width and height, reading and collecting
 // the requested number of views, and calibrating the camera
 #include <iostream>
+#include <algorithm>
+#include <iomanip>
+#include <set>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/calib3d.hpp>
-#include "reader.h"
+#include "chessboard.h"
+#include "camera_profile.h"
+#include "calib_cache.h"
+#include "image_source.h"
+#include "sparse_calib.h"
 
 using std::vector;
 using std::cout;
 using std::cerr;
 using std::endl;
 
+// run both solvers from the same start on the same views and print how far the sparse result is from the dense one
+// the dense result is returned in cameraMatrix and distCoeffs, with its RMS error
+double compareSolvers(const vector<vector<cv::Point3f>>& objectPoints, const vector<vector<cv::Point2f>>& imagePoints, cv::Size imageSize,
+	cv::Mat& cameraMatrix, cv::Mat& distCoeffs, int flags)
+{
+	cv::Mat denseCamera = cameraMatrix.clone(), denseDist = distCoeffs.clone();
+	cv::Mat sparseCamera = cameraMatrix.clone(), sparseDist = distCoeffs.clone();
+
+	int64 tick = cv::getTickCount();
+	double denseErr = cv::calibrateCamera(objectPoints, imagePoints, imageSize, denseCamera, denseDist, cv::noArray(), cv::noArray(), flags);
+	double denseSec = static_cast<double>(cv::getTickCount() - tick) / cv::getTickFrequency();
+	tick = cv::getTickCount();
+	double sparseErr = calibrateCameraSparse(objectPoints, imagePoints, imageSize, sparseCamera, sparseDist, flags);
+	double sparseSec = static_cast<double>(cv::getTickCount() - tick) / cv::getTickFrequency();
+
+	auto row = [](const std::string& name, double dense, double sparse) {
+		cout << std::left << std::setw(10) << name << std::right << std::setw(14) << dense << std::setw(14) << sparse << std::setw(14) << sparse - dense << "\n";
+	};
+	cout << std::left << std::setw(10) << "" << std::right << std::setw(14) << "dense" << std::setw(14) << "sparse" << std::setw(14) << "delta" << "\n";
+	const char* intrinsics[] = { "fx", "fy", "cx", "cy" };
+	const cv::Point cells[] = { { 0, 0 }, { 1, 1 }, { 2, 0 }, { 2, 1 } };
+	for (int i = 0; i < 4; ++i)
+		row(intrinsics[i], denseCamera.at<double>(cells[i]), sparseCamera.at<double>(cells[i]));
+	const char* coeffs[] = { "k1", "k2", "p1", "p2", "k3" };
+	cv::Mat dense = denseDist.reshape(1, 1), sparse = sparseDist.reshape(1, 1);
+	for (int i = 0; i < 5; ++i)
+		row(coeffs[i], i < dense.cols ? dense.at<double>(i) : 0, i < sparse.cols ? sparse.at<double>(i) : 0);
+	row("RMS", denseErr, sparseErr);
+	row("seconds", denseSec, sparseSec);
+
+	cameraMatrix = denseCamera;
+	distCoeffs = denseDist;
+	return denseErr;
+}
+
 
 int main(int argc, char* argv[]) {
 
-	if (argc < 4 || argc > 6) {
+	if (argc < 4 || argc > 9) {
 		cout << "Error: Unexpected number of input parameters\n";
-		cout << "Usage: " << argv[0] << " [ImageDirectory] [WidthCornerCount] [HeightCornerCount] [optional:ShowRemapResult] [optional:ShowCornerFound]\n";
+		cout << "Usage: " << argv[0] << " [ImageDirectory] [WidthCornerCount] [HeightCornerCount] [optional:ShowRemapResult] [optional:ShowCornerFound] [optional:MaxViews] [optional:PreviousResult] [optional:Solver]\n";
 		cout << "ImageDirectory: Directory of images, end with \\\n";
 		cout << "WidthCornerCount: The number of corners in one row\n";
 		cout << "HeightCornerCount: The number of corners in one col\n";
 		cout << "ShowRemapResult(default n): y/n, if y, a widget will be opened to show the remap result of all input images\n";
 		cout << "ShowCornerFound(default n): y/n, if y, a widget will be opened to show the corners found of all input images\n";
+		cout << "MaxViews(default 40): The number of views with the most diverse board poses used to calibrate, all views when 0\n";
+		cout << "PreviousResult: The intrinsics xml of an earlier run used as the initial guess, nothing is solved when it was solved from every view found\n";
+		cout << "Solver(default dense): dense for calibrateCamera, sparse for the Schur complement solver that scales to many views,\n";
+		cout << "    compare to run both on the same views and print how their results differ, the dense result is stored\n";
+		cout << "The corners of every image are cached in ImageDirectory, only images added since the last run are searched\n";
 		return -1;
 	}
 	// 12 * 12
@@ -38,92 +85,136 @@ int main(int argc, char* argv[]) {
 		if (remap == "y")
 			showRemap = true;
 	}
-	if (argc == 6)
+	if (argc >= 6)
 	{
 		std::string corner = argv[5];
 		if (corner == "y")
 			showCorners = true;
 	}
+	int maxViews = argc >= 7 ? std::stoi(argv[6]) : 40;
+	std::string previousPath = argc >= 8 ? argv[7] : "";
+	std::string solver = argc >= 9 ? argv[8] : "dense";
+	bool sparse = solver == "sparse";
 
-	cout << "Loading images...\n";
-	vector<cv::Mat> images = loadImages(imageDir);
+	cv::Size cornerSize(widthCorner, heightCorner);
 
-	// rotate to the same direction
-	for (auto& image : images)
+	vector<std::string> files = listImages(imageDir);
+	if (files.empty())
 	{
-		if (image.rows > image.cols)
-			cv::rotate(image, image, cv::ROTATE_90_CLOCKWISE);
+		cout << "Cannot find any image in " + imageDir << endl;
+		return -1;
 	}
 
-	cv::Size cornerSize(widthCorner, heightCorner);
-
-	// Collection of corner position for every image
-	vector<vector<cv::Point2f>> imagePoints;
-	// Collection of corner coordinates for every image in object coordinate system
-	vector<vector<cv::Point3f>> objectPoints;
-
 	cout << "Searching corners...\n";
-	for (auto& image : images)
+	CornerCache cornerCache(cornerSize);
+	std::string cornerCachePath = CornerCache::defaultPath(imageDir, cornerSize);
+	cornerCache.load(cornerCachePath);
+	cv::Size imageSize;
+	int searched = 0;
+	vector<uint64_t> viewHashes;
+	vector<BoardView> views = cornerCache.findViews(files, imageSize, searched, viewHashes);
+	if (searched > 0 && !cornerCache.save(cornerCachePath))
+		cout << "Cannot write the corner cache " << cornerCachePath << endl;
+	cout << "Searched " << searched << " new images, board found in " << views.size() << " of " << files.size() << " images\n";
+	if (views.empty())
 	{
-		cv::Mat grayImage;
-		cv::cvtColor(image, grayImage, cv::COLOR_BGR2GRAY);
-
-		vector<cv::Point2f> corners;
-		bool patternWasFound = cv::findChessboardCorners(grayImage, cornerSize, corners);
-		if (showCorners)
-			drawChessboardCorners(image, cornerSize, corners, patternWasFound);
-		imagePoints.push_back(corners);
-
-		if (patternWasFound)
-		{
-			vector<cv::Point3f> opts;
-			int boardsNum = widthCorner * heightCorner;
-			opts.resize(boardsNum);
-			for (int i = 0; i < boardsNum; i++)
-			{
-				opts[i] = cv::Point3f(static_cast<float>(i / widthCorner),
-					static_cast<float>(i % widthCorner), 0.0f);
-			}
-			objectPoints.push_back(opts);
-		}
+		cout << "Error: Couldn't find the checkerboard in any image\n";
+		return -1;
+	}
 
-		if (showCorners)
+	if (showCorners)
+	{
+		for (auto& view : views)
 		{
+			ImageSourceOptions options;
+			options.landscape = true;
+			cv::Mat image = readImage(files[view.index], options);
+			cv::drawChessboardCorners(image, cornerSize, view.corners, true);
 			cv::imshow("Calibration", image);
 			cv::waitKey();
 		}
-	}
-	if (showCorners)
 		cv::destroyWindow("Calibration");
-	cout << "Calibrating..." << endl;
-
+	}
 
+	// start from the previous solution, only worth solving again with new views
 	cv::Mat cameraMatrix, distCoeffs;
-	double err = cv::calibrateCamera(objectPoints, imagePoints, images[0].size(),
-		cameraMatrix, distCoeffs, cv::noArray(), cv::noArray(),
-		cv::CALIB_ZERO_TANGENT_DIST | cv::CALIB_FIX_PRINCIPAL_POINT);
+	int flags = cv::CALIB_ZERO_TANGENT_DIST | cv::CALIB_FIX_PRINCIPAL_POINT;
+	CameraProfile previous;
+	bool incremental = !previousPath.empty() && previous.load(previousPath) && previous.getImageSize() == imageSize;
+	if (!previousPath.empty() && !incremental)
+		cout << "Couldn't use " << previousPath << " as the initial guess, calibrating from scratch\n";
+	if (incremental)
+	{
+		cameraMatrix = previous.getCameraMatrix().clone();
+		distCoeffs = previous.getDistCoeffs().clone();
+		flags |= cv::CALIB_USE_INTRINSIC_GUESS;
+	}
+
+	// new to the previous solve, not to the corner cache, which is saved before any solve
+	vector<int> added;
+	std::set<uint64_t> solved(previous.getViewHashes().begin(), previous.getViewHashes().end());
+	for (int i = 0; i < viewHashes.size(); ++i)
+		if (solved.count(viewHashes[i]) == 0)
+			added.push_back(i);
 
-	// save result
-	cout << "Reprojection error is " << err << endl;
+	if (incremental && added.empty())
+	{
+		cout << "No view was added since " << previousPath << ", keeping its intrinsics\n";
+	}
+	else
+	{
+		// the new views are what the re-solve is for, they are kept and the rest is chosen around them
+		vector<BoardView> selected = selectDiverseViews(views, cornerSize, imageSize, maxViews, incremental ? added : vector<int>());
+		int newUsed = 0;
+		for (int i : added)
+			newUsed += std::any_of(selected.begin(), selected.end(), [&](const BoardView& view) { return view.index == views[i].index; });
+		views = std::move(selected);
+
+		// Collection of corner position for every image
+		vector<vector<cv::Point2f>> imagePoints;
+		// Collection of corner coordinates for every image in object coordinate system
+		vector<vector<cv::Point3f>> objectPoints;
+		for (auto& view : views)
+		{
+			imagePoints.push_back(view.corners);
+			objectPoints.push_back(boardObjectPoints(cornerSize));
+		}
+		cout << "Calibrating with " << views.size() << " views" << (incremental ? ", " + std::to_string(newUsed) + " of " + std::to_string(added.size()) + " new views" : "") << "..." << endl;
+
+		double err;
+		if (solver == "compare")
+			err = compareSolvers(objectPoints, imagePoints, imageSize, cameraMatrix, distCoeffs, flags);
+		else
+			err = sparse ? calibrateCameraSparse(objectPoints, imagePoints, imageSize, cameraMatrix, distCoeffs, flags)
+				: cv::calibrateCamera(objectPoints, imagePoints, imageSize,
+					cameraMatrix, distCoeffs, cv::noArray(), cv::noArray(), flags);
+
+		// save result
+		cout << "Reprojection error is " << err << endl;
+	}
 	cout << "Storing Intrinsics.xml files...\n";
 
-	cv::FileStorage fs("intrinsics.xml", cv::FileStorage::WRITE);
-	fs << "ImageWidth" << images[0].cols << "ImageHeight" << images[0].rows
-		<< "CameraMatrix" << cameraMatrix << "DistortionCoefficients" << distCoeffs;
-	fs.release();
+	// the undistortion maps of the image size are stored beside the intrinsics
+	CameraProfile profile(cameraMatrix, distCoeffs, imageSize);
+	// every view the solve chose from, only written once the solve succeeded
+	profile.setViewHashes(viewHashes);
+	if (!profile.save("intrinsics.xml"))
+		cout << "Cannot write the undistortion maps beside intrinsics.xml\n";
 
 	cout << "Done.\n";
 
 	if (showRemap) {
 
-		cv::Mat map1, map2;
-		cv::initUndistortRectifyMap(cameraMatrix, distCoeffs, cv::Mat(), cameraMatrix
-			, images[0].size(), CV_16SC2, map1, map2);
-
-		for (auto& image : images)
+		// decoded ahead while the previous image is shown
+		ImageSourceOptions options;
+		options.landscape = true;
+		ImageSource source(files, options);
+		cv::Mat image, undistorted;
+		int index;
+		while (source.next(image, index))
 		{
-			cv::remap(image, image, map1, map2, cv::INTER_LINEAR);
-			cv::imshow("Undistorted", image);
+			profile.undistort(image, undistorted);
+			cv::imshow("Undistorted", undistorted);
 			cv::waitKey();
 		}
 	}
@@ -0,0 +1,189 @@
+#include "camera_profile.h"
+#include <opencv2/imgproc.hpp>
+#include <opencv2/calib3d.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+
+
+constexpr char MapFileMagic[4] = { 'U', 'D', 'M', 'P' };
+constexpr int32_t MapFileVersion = 1;
+// distortion coefficients kept in the map header, the most calibrateCamera returns
+constexpr int MaxDistCoeffs = 14;
+
+// header of a map file, the intrinsics tell whether the maps still belong to the profile
+struct MapFileHeader
+{
+	char magic[4];
+	int32_t version;
+	int32_t width, height;
+	double camera[9];
+	int32_t distNum;
+	double dist[MaxDistCoeffs];
+};
+
+void fillHeader(const cv::Mat& cameraMatrix, const cv::Mat& distCoeffs, cv::Size size, MapFileHeader& header)
+{
+	header = MapFileHeader();
+	std::copy(MapFileMagic, MapFileMagic + 4, header.magic);
+	header.version = MapFileVersion;
+	header.width = size.width;
+	header.height = size.height;
+
+	cv::Mat camera, dist;
+	cameraMatrix.convertTo(camera, CV_64F);
+	distCoeffs.reshape(1, 1).convertTo(dist, CV_64F);
+	for (int i = 0; i < 9; ++i)
+		header.camera[i] = camera.at<double>(i / 3, i % 3);
+	header.distNum = std::min(static_cast<int>(dist.total()), MaxDistCoeffs);
+	for (int i = 0; i < header.distNum; ++i)
+		header.dist[i] = dist.at<double>(i);
+}
+
+CameraProfile::CameraProfile(const cv::Mat& cameraMatrix, const cv::Mat& distCoeffs, cv::Size imageSize)
+	: cameraMatrix(cameraMatrix.clone()), distCoeffs(distCoeffs.clone()), imageSize(imageSize)
+{
+}
+
+bool CameraProfile::load(const std::string& path)
+{
+	cv::FileStorage fs(path, cv::FileStorage::READ);
+	if (!fs.isOpened())
+		return false;
+
+	fs["CameraMatrix"] >> cameraMatrix;
+	fs["DistortionCoefficients"] >> distCoeffs;
+	int width = 0, height = 0;
+	fs["ImageWidth"] >> width;
+	fs["ImageHeight"] >> height;
+	// FileStorage has no 64 bit integers, the hashes are hex strings
+	viewHashes.clear();
+	cv::FileNode hashes = fs["ViewHashes"];
+	for (auto it = hashes.begin(); it != hashes.end(); ++it)
+		viewHashes.push_back(std::stoull(static_cast<std::string>(*it), nullptr, 16));
+	fs.release();
+	if (cameraMatrix.empty() || distCoeffs.empty())
+		return false;
+
+	imageSize = cv::Size(width, height);
+	this->path = path;
+	std::lock_guard<std::mutex> lock(tablesLock);
+	tables.clear();
+	return true;
+}
+
+bool CameraProfile::save(const std::string& path, bool writeMaps)
+{
+	cv::FileStorage fs(path, cv::FileStorage::WRITE);
+	if (!fs.isOpened())
+		return false;
+	fs << "ImageWidth" << imageSize.width << "ImageHeight" << imageSize.height
+		<< "CameraMatrix" << cameraMatrix << "DistortionCoefficients" << distCoeffs;
+	if (!viewHashes.empty())
+	{
+		fs << "ViewHashes" << "[";
+		for (uint64_t hash : viewHashes)
+		{
+			std::stringstream ss;
+			ss << std::hex << hash;
+			fs << ss.str();
+		}
+		fs << "]";
+	}
+	fs.release();
+
+	this->path = path;
+	if (writeMaps && imageSize.area() > 0)
+		return writeTables(imageSize, getTables(imageSize));
+	return true;
+}
+
+std::string CameraProfile::mapPath(cv::Size size) const
+{
+	// intrinsics.xml -> intrinsics_1920x1080.map
+	size_t dot = path.find_last_of('.');
+	size_t slash = path.find_last_of("/\\");
+	std::string stem = dot != std::string::npos && (slash == std::string::npos || dot > slash) ? path.substr(0, dot) : path;
+	return stem + "_" + std::to_string(size.width) + "x" + std::to_string(size.height) + ".map";
+}
+
+bool CameraProfile::readTables(cv::Size size, RemapTables& maps) const
+{
+	std::ifstream in(mapPath(size), std::ios::binary);
+	if (!in.is_open())
+		return false;
+
+	MapFileHeader header, expected;
+	fillHeader(cameraMatrix, distCoeffs, size, expected);
+	in.read(reinterpret_cast<char*>(&header), sizeof(header));
+	// stale maps of an older calibration are rebuilt
+	if (!in || !std::equal(header.magic, header.magic + 4, MapFileMagic) || header.version != MapFileVersion
+		|| header.width != size.width || header.height != size.height
+		|| !std::equal(header.camera, header.camera + 9, expected.camera)
+		|| header.distNum != expected.distNum || !std::equal(header.dist, header.dist + header.distNum, expected.dist))
+		return false;
+
+	maps.map1.create(size, CV_16SC2);
+	maps.map2.create(size, CV_16UC1);
+	in.read(reinterpret_cast<char*>(maps.map1.data), maps.map1.total() * maps.map1.elemSize());
+	in.read(reinterpret_cast<char*>(maps.map2.data), maps.map2.total() * maps.map2.elemSize());
+	return static_cast<bool>(in);
+}
+
+bool CameraProfile::writeTables(cv::Size size, const RemapTables& maps) const
+{
+	if (path.empty())
+		return false;
+	std::ofstream out(mapPath(size), std::ios::binary);
+	if (!out.is_open())
+		return false;
+
+	MapFileHeader header;
+	fillHeader(cameraMatrix, distCoeffs, size, header);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	// maps from initUndistortRectifyMap are continuous
+	out.write(reinterpret_cast<const char*>(maps.map1.data), maps.map1.total() * maps.map1.elemSize());
+	out.write(reinterpret_cast<const char*>(maps.map2.data), maps.map2.total() * maps.map2.elemSize());
+	return static_cast<bool>(out);
+}
+
+cv::Mat CameraProfile::scaledCameraMatrix(cv::Size size) const
+{
+	cv::Mat camera;
+	cameraMatrix.convertTo(camera, CV_64F);
+	if (imageSize.area() == 0 || size == imageSize)
+		return camera;
+
+	// the focal length and the principal point follow the pixel size
+	double sx = static_cast<double>(size.width) / imageSize.width;
+	double sy = static_cast<double>(size.height) / imageSize.height;
+	camera.row(0) *= sx;
+	camera.row(1) *= sy;
+	return camera;
+}
+
+const CameraProfile::RemapTables& CameraProfile::getTables(cv::Size size)
+{
+	std::lock_guard<std::mutex> lock(tablesLock);
+	auto key = std::make_pair(size.width, size.height);
+	auto it = tables.find(key);
+	if (it != tables.end())
+		return it->second;
+
+	RemapTables maps;
+	if (path.empty() || !readTables(size, maps))
+	{
+		cv::Mat camera = scaledCameraMatrix(size);
+		cv::initUndistortRectifyMap(camera, distCoeffs, cv::Mat(), camera, size, CV_16SC2, maps.map1, maps.map2);
+		writeTables(size, maps);
+	}
+	return tables.emplace(key, maps).first->second;
+}
+
+void CameraProfile::undistort(const cv::Mat& src, cv::Mat& dst)
+{
+	const RemapTables& maps = getTables(src.size());
+	// remap already splits the rows over the thread pool
+	cv::remap(src, dst, maps.map1, maps.map2, cv::INTER_LINEAR);
+}
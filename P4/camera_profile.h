@@ -0,0 +1,69 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+/*
+ * Intrinsics of a calibrated camera together with its undistortion maps.
+ * The fixed point CV_16SC2 maps are built once per image size and stored next to the intrinsics file,
+ * so undistorting a frame is a single table driven remap.
+ */
+class CameraProfile
+{
+	cv::Mat cameraMatrix, distCoeffs;
+	// size of the calibration images
+	cv::Size imageSize;
+	// intrinsics file, the maps of every size are stored beside it, empty before save or load
+	std::string path;
+	// hashFile of the views the intrinsics were solved from, empty when unknown
+	std::vector<uint64_t> viewHashes;
+
+	struct RemapTables
+	{
+		cv::Mat map1, map2;
+	};
+	// keyed by width and height
+	std::map<std::pair<int, int>, RemapTables> tables;
+	std::mutex tablesLock;
+
+	// path of the map file of the size
+	std::string mapPath(cv::Size size) const;
+	bool readTables(cv::Size size, RemapTables& maps) const;
+	bool writeTables(cv::Size size, const RemapTables& maps) const;
+	const RemapTables& getTables(cv::Size size);
+public:
+	CameraProfile() = default;
+	CameraProfile(const cv::Mat& cameraMatrix, const cv::Mat& distCoeffs, cv::Size imageSize);
+
+	/*
+	 * Read the intrinsics written by save or by the calibrator.
+	 * @return false when the file misses the camera matrix or the distortion coefficients
+	 */
+	bool load(const std::string& path);
+	/*
+	 * Write the intrinsics, and the maps of the calibration size unless writeMaps is false.
+	 * Maps built later for other sizes are written beside it as they are built.
+	 */
+	bool save(const std::string& path, bool writeMaps = true);
+
+	// camera matrix scaled to the size, the same matrix for the calibration size
+	cv::Mat scaledCameraMatrix(cv::Size size) const;
+
+	/*
+	 * Undistort by the maps of the size of src, the maps are read from disk or built on first use.
+	 */
+	void undistort(const cv::Mat& src, cv::Mat& dst);
+
+	const cv::Mat& getCameraMatrix() const { return cameraMatrix; }
+	const cv::Mat& getDistCoeffs() const { return distCoeffs; }
+	cv::Size getImageSize() const { return imageSize; }
+
+	// the views of the solve, stored with the intrinsics so a later run can tell which views are new to it
+	void setViewHashes(const std::vector<uint64_t>& hashes) { viewHashes = hashes; }
+	const std::vector<uint64_t>& getViewHashes() const { return viewHashes; }
+};
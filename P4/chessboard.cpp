@@ -0,0 +1,233 @@
+#include "chessboard.h"
+#include <opencv2/imgproc.hpp>
+#include <opencv2/calib3d.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+
+// cells per side of the grid measuring how much of the image the chosen boards cover
+constexpr int CoverageGrid = 8;
+// weight of the share of newly covered cells against the pose distance
+constexpr double CoverageWeight = 1.0;
+
+// the board is searched on the image halved until no side is longer than this
+constexpr int CoarseMaxSide = 1000;
+// half side of the sub pixel search window at full resolution
+constexpr int RefineWindow = 11;
+
+// refine the corners inside their bounding box only, the window is kept inside one square of the board
+void refineInRoi(const cv::Mat& gray, cv::Size cornerSize, std::vector<cv::Point2f>& corners)
+{
+	float spacing = FLT_MAX;
+	for (int i = 0; i + 1 < corners.size(); ++i)
+		if ((i + 1) % cornerSize.width != 0)
+			spacing = std::min(spacing, static_cast<float>(cv::norm(corners[i + 1] - corners[i])));
+	int win = std::min(RefineWindow, std::max(2, cvFloor(spacing * 0.4f)));
+
+	cv::Rect roi = cv::boundingRect(corners);
+	roi.x -= win + 2;
+	roi.y -= win + 2;
+	roi.width += 2 * win + 4;
+	roi.height += 2 * win + 4;
+	roi &= cv::Rect(0, 0, gray.cols, gray.rows);
+
+	cv::Point2f offset(static_cast<float>(roi.x), static_cast<float>(roi.y));
+	for (auto& p : corners)
+		p -= offset;
+	cv::cornerSubPix(gray(roi), corners, cv::Size(win, win), cv::Size(-1, -1),
+		cv::TermCriteria(cv::TermCriteria::EPS | cv::TermCriteria::COUNT, 30, 0.1));
+	for (auto& p : corners)
+		p += offset;
+}
+
+bool findBoardCorners(const cv::Mat& gray, cv::Size cornerSize, std::vector<cv::Point2f>& corners, int flags)
+{
+	corners.clear();
+	std::vector<cv::Mat> pyramid{ gray };
+	while (std::max(pyramid.back().cols, pyramid.back().rows) > CoarseMaxSide)
+	{
+		cv::Mat down;
+		cv::pyrDown(pyramid.back(), down);
+		pyramid.push_back(down);
+	}
+
+	// frames without a board are rejected by the fast check on the smallest level
+	int level = static_cast<int>(pyramid.size()) - 1;
+	bool found = cv::findChessboardCorners(pyramid[level], cornerSize, corners, level > 0 ? flags | cv::CALIB_CB_FAST_CHECK : flags);
+	if (!found)
+	{
+		for (auto& p : corners)
+			p *= static_cast<float>(1 << level);
+		return false;
+	}
+
+	// Get Subpixel accuracy on those corners, level by level up to the full resolution
+	for (; level >= 0; --level)
+	{
+		refineInRoi(pyramid[level], cornerSize, corners);
+		if (level > 0)
+			for (auto& p : corners)
+				p *= 2.0f;
+	}
+	return true;
+}
+
+std::vector<BoardView> findBoardViews(const std::vector<cv::Mat>& images, cv::Size cornerSize)
+{
+	int n = images.size();
+	std::vector<std::vector<cv::Point2f>> corners(n);
+	std::vector<char> found(n, 0);
+
+	// one stripe per image, the search time varies a lot with the content
+	cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& range)
+		{
+			for (int i = range.start; i < range.end; ++i)
+			{
+				cv::Mat gray;
+				if (images[i].channels() == 1)
+					gray = images[i];
+				else
+					cv::cvtColor(images[i], gray, images[i].channels() == 4 ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY);
+				found[i] = findBoardCorners(gray, cornerSize, corners[i]);
+			}
+		}, n);
+
+	std::vector<BoardView> views;
+	for (int i = 0; i < n; ++i)
+		if (found[i])
+			views.push_back({ i, std::move(corners[i]) });
+	return views;
+}
+
+// position, size, roll and tilt of the board, all roughly in [-1, 1]
+cv::Vec6d poseFeature(const std::vector<cv::Point2f>& corners, cv::Size cornerSize, cv::Size imageSize)
+{
+	const cv::Point2f& leftTop = corners[0];
+	const cv::Point2f& rightTop = corners[cornerSize.width - 1];
+	const cv::Point2f& leftBottom = corners[(cornerSize.height - 1) * cornerSize.width];
+	const cv::Point2f& rightBottom = corners[cornerSize.height * cornerSize.width - 1];
+
+	double diag = std::sqrt(static_cast<double>(imageSize.width) * imageSize.width + static_cast<double>(imageSize.height) * imageSize.height);
+	cv::Point2f center = (leftTop + rightTop + leftBottom + rightBottom) * 0.25f;
+
+	double top = cv::norm(rightTop - leftTop), bottom = cv::norm(rightBottom - leftBottom);
+	double left = cv::norm(leftBottom - leftTop), right = cv::norm(rightBottom - rightTop);
+	cv::Point2f edge = rightTop - leftTop;
+
+	return cv::Vec6d(2.0 * center.x / imageSize.width - 1,
+		2.0 * center.y / imageSize.height - 1,
+		// the side of the board relative to the image
+		2.0 * std::sqrt(std::max(top, bottom) * std::max(left, right)) / diag,
+		std::atan2(edge.y, edge.x) / CV_PI,
+		// perspective shortens the far edge, the log ratios of opposite edges measure the tilt about both axes
+		std::log(std::max(left, 1e-3) / std::max(right, 1e-3)),
+		std::log(std::max(top, 1e-3) / std::max(bottom, 1e-3)));
+}
+
+// cell row * CoverageGrid + col is set when a corner falls into it
+std::vector<char> coveredCells(const std::vector<cv::Point2f>& corners, cv::Size imageSize)
+{
+	std::vector<char> cells(CoverageGrid * CoverageGrid, 0);
+	for (auto& p : corners)
+	{
+		int col = std::min(std::max(static_cast<int>(p.x * CoverageGrid / imageSize.width), 0), CoverageGrid - 1);
+		int row = std::min(std::max(static_cast<int>(p.y * CoverageGrid / imageSize.height), 0), CoverageGrid - 1);
+		cells[row * CoverageGrid + col] = 1;
+	}
+	return cells;
+}
+
+std::vector<BoardView> selectDiverseViews(const std::vector<BoardView>& views, cv::Size cornerSize, cv::Size imageSize, int maxViews,
+	const std::vector<int>& required)
+{
+	int n = views.size();
+	if (maxViews <= 0 || n <= maxViews)
+		return views;
+	if (static_cast<int>(required.size()) >= maxViews)
+	{
+		std::vector<BoardView> subset;
+		for (int i : required)
+			subset.push_back(views[i]);
+		return selectDiverseViews(subset, cornerSize, imageSize, maxViews);
+	}
+
+	std::vector<cv::Vec6d> features(n);
+	std::vector<std::vector<char>> cells(n);
+	cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& range)
+		{
+			for (int i = range.start; i < range.end; ++i)
+			{
+				features[i] = poseFeature(views[i].corners, cornerSize, imageSize);
+				cells[i] = coveredCells(views[i].corners, imageSize);
+			}
+		});
+
+	std::vector<char> chosen(n, 0);
+	std::vector<double> minDist(n, DBL_MAX);
+	std::vector<char> covered(CoverageGrid * CoverageGrid, 0);
+	std::vector<BoardView> selected;
+	auto choose = [&](int v)
+	{
+		if (chosen[v])
+			return;
+		chosen[v] = 1;
+		selected.push_back(views[v]);
+		for (int c = 0; c < covered.size(); ++c)
+			covered[c] |= cells[v][c];
+		for (int i = 0; i < n; ++i)
+			if (!chosen[i])
+				minDist[i] = std::min(minDist[i], cv::norm(features[i] - features[v]));
+	};
+
+	if (required.empty())
+	{
+		// start from the largest board, it constrains the focal length best
+		int first = 0;
+		for (int i = 1; i < n; ++i)
+			if (features[i][2] > features[first][2])
+				first = i;
+		choose(first);
+	}
+	for (int v : required)
+		choose(v);
+
+	while (static_cast<int>(selected.size()) < maxViews)
+	{
+		double bestScore = -1;
+		int best = -1;
+		for (int i = 0; i < n; ++i)
+		{
+			if (chosen[i])
+				continue;
+			int gain = 0;
+			for (int c = 0; c < covered.size(); ++c)
+				gain += cells[i][c] && !covered[c];
+			double score = minDist[i] + CoverageWeight * gain / covered.size();
+			if (score > bestScore)
+			{
+				bestScore = score;
+				best = i;
+			}
+		}
+		if (best < 0)
+			break;
+		choose(best);
+	}
+
+	// keep the input order
+	std::sort(selected.begin(), selected.end(), [](const BoardView& a, const BoardView& b) { return a.index < b.index; });
+	return selected;
+}
+
+std::vector<cv::Point3f> boardObjectPoints(cv::Size cornerSize)
+{
+	int boardsNum = cornerSize.width * cornerSize.height;
+	std::vector<cv::Point3f> opts(boardsNum);
+	for (int i = 0; i < boardsNum; i++)
+	{
+		opts[i] = cv::Point3f(static_cast<float>(i / cornerSize.width),
+			static_cast<float>(i % cornerSize.width), 0.0f);
+	}
+	return opts;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <vector>
+
+
+// corners of one view where the whole board was found
+struct BoardView
+{
+	// index of the view in the input images
+	int index;
+	std::vector<cv::Point2f> corners;
+};
+
+/*
+ * Find the corners of the chessboard in a gray image and refine them to sub pixel accuracy.
+ * Large images are searched halved with a fast check first, then the corners are refined level by level inside the board only.
+ * @param flags passed to findChessboardCorners
+ * @return false when not all corners are found
+ */
+bool findBoardCorners(const cv::Mat& gray, cv::Size cornerSize, std::vector<cv::Point2f>& corners,
+	int flags = cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE);
+
+/*
+ * Find the chessboard in every image on all threads.
+ * Views without the whole board are dropped, so the result always lines up with boardObjectPoints.
+ * @param images color or gray images
+ */
+std::vector<BoardView> findBoardViews(const std::vector<cv::Mat>& images, cv::Size cornerSize);
+
+/*
+ * Choose the views that differ most in board pose and together cover the image best.
+ * Views are added greedily, each time the one farthest from the chosen poses, with a bonus for image cells no chosen board covers yet.
+ * @param maxViews the number of views kept, all views when not positive
+ * @param required positions in views that are always kept and seed the selection, chosen among themselves when there are more than maxViews
+ */
+std::vector<BoardView> selectDiverseViews(const std::vector<BoardView>& views, cv::Size cornerSize, cv::Size imageSize, int maxViews,
+	const std::vector<int>& required = {});
+
+// corner coordinates in the object coordinate system, the same for every view
+std::vector<cv::Point3f> boardObjectPoints(cv::Size cornerSize);
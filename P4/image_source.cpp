@@ -0,0 +1,111 @@
+#include "image_source.h"
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <iostream>
+
+namespace fs = std::filesystem;
+
+
+std::string lowerCase(std::string str)
+{
+	std::transform(str.begin(), str.end(), str.begin(), [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+	return str;
+}
+
+std::vector<std::string> listImages(const std::string& dir, const std::string& ext)
+{
+	std::vector<std::string> paths;
+	std::error_code error;
+	fs::directory_iterator it(dir, error);
+	if (error)
+		return paths;
+
+	std::string wanted = lowerCase(ext);
+	for (const auto& entry : it)
+	{
+		if (!entry.is_regular_file(error))
+			continue;
+		if (lowerCase(entry.path().extension().string()) == wanted)
+			paths.push_back(entry.path().string());
+	}
+	std::sort(paths.begin(), paths.end());
+	return paths;
+}
+
+cv::Mat readImage(const std::string& path, const ImageSourceOptions& options)
+{
+	cv::Mat image = cv::imread(path, options.grayscale ? cv::IMREAD_GRAYSCALE : cv::IMREAD_COLOR);
+	if (!image.empty() && options.landscape && image.rows > image.cols)
+		cv::rotate(image, image, cv::ROTATE_90_CLOCKWISE);
+	return image;
+}
+
+ImageSource::ImageSource(std::vector<std::string> files, const ImageSourceOptions& options)
+	: files(std::move(files)), options(options), decoded(std::max(options.prefetch, 1))
+{
+	int window = std::max(options.prefetch, 1);
+	decoder = std::thread([this, window]()
+		{
+			int n = static_cast<int>(this->files.size());
+			std::vector<cv::Mat> images(window);
+			for (int start = 0; start < n; start += window)
+			{
+				int count = std::min(window, n - start);
+				cv::parallel_for_(cv::Range(0, count), [&](const cv::Range& range)
+					{
+						for (int i = range.start; i < range.end; ++i)
+							images[i] = readImage(this->files[start + i], this->options);
+					}, count);
+
+				for (int i = 0; i < count; ++i)
+				{
+					if (images[i].empty())
+					{
+						std::cout << "Cannot read image " << this->files[start + i] << std::endl;
+						continue;
+					}
+					// the queue holds one window while the next one is decoded
+					if (!decoded.push(std::make_pair(start + i, std::move(images[i]))))
+						return;
+					images[i] = cv::Mat();
+				}
+			}
+			decoded.close();
+		});
+}
+
+ImageSource::~ImageSource()
+{
+	// a consumer stopping early unblocks the decoder
+	decoded.close();
+	if (decoder.joinable())
+		decoder.join();
+}
+
+bool ImageSource::next(cv::Mat& image, int& index)
+{
+	std::pair<int, cv::Mat> item;
+	if (!decoded.pop(item))
+		return false;
+	index = item.first;
+	image = std::move(item.second);
+	return true;
+}
+
+bool ImageSource::nextBatch(std::vector<cv::Mat>& images, std::vector<int>& indices, int max)
+{
+	images.clear();
+	indices.clear();
+	cv::Mat image;
+	int index;
+	while (static_cast<int>(images.size()) < max && next(image, index))
+	{
+		images.push_back(std::move(image));
+		indices.push_back(index);
+		image = cv::Mat();
+	}
+	return !images.empty();
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "BoundedQueue.h"
+
+
+struct ImageSourceOptions
+{
+	// decode to one channel, the corner search needs nothing more
+	bool grayscale = false;
+	// rotate portrait images clockwise so every image has the same direction
+	bool landscape = false;
+	// images decoded ahead of the consumer, also the number decoded together on the thread pool
+	int prefetch = 16;
+};
+
+/*
+ * Images of the directory with the extension in name order, case insensitive.
+ * @param ext with the dot, e.g. ".jpg"
+ */
+std::vector<std::string> listImages(const std::string& dir, const std::string& ext = ".jpg");
+
+/*
+ * Read one image with the options applied.
+ * @return an empty Mat when the file cannot be decoded
+ */
+cv::Mat readImage(const std::string& path, const ImageSourceOptions& options);
+
+/*
+ * Stream of decoded images.
+ * A background thread decodes the next prefetch images on all threads while the consumer works,
+ * so at most about two prefetch windows are held in memory at any time.
+ */
+class ImageSource
+{
+	std::vector<std::string> files;
+	ImageSourceOptions options;
+	// index of the file and its image, unreadable files are skipped
+	BoundedQueue<std::pair<int, cv::Mat>> decoded;
+	std::thread decoder;
+public:
+	ImageSource(std::vector<std::string> files, const ImageSourceOptions& options = ImageSourceOptions());
+	~ImageSource();
+	ImageSource(const ImageSource&) = delete;
+	ImageSource& operator=(const ImageSource&) = delete;
+
+	/*
+	 * Next image in the order of the files.
+	 * @param index the index of its file
+	 * @return false when every file has been delivered
+	 */
+	bool next(cv::Mat& image, int& index);
+	/*
+	 * Up to max next images, fewer only at the end.
+	 * @return false when every file has been delivered
+	 */
+	bool nextBatch(std::vector<cv::Mat>& images, std::vector<int>& indices, int max);
+
+	const std::vector<std::string>& getFiles() const { return files; }
+};
@@ -0,0 +1,274 @@
+#include "sparse_calib.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+
+// fx fy cx cy k1 k2 p1 p2 k3, the order of the columns after the pose in the jacobian of projectPoints
+constexpr int IntrinsicNum = 9;
+// rvec and tvec of one view
+constexpr int PoseNum = 6;
+// the damping grows by this factor after a rejected step, and shrinks by it after an accepted one
+constexpr double DampingFactor = 10;
+constexpr double MaxDamping = 1e12;
+
+// normal equations of one view, split into the pose block V, the intrinsic block U and the coupling W
+struct ViewBlock
+{
+	cv::Matx66d V;
+	cv::Vec6d gb;
+	// IntrinsicNum free x PoseNum, free x free, free x 1
+	cv::Mat W, U, ga;
+	double cost = 0;
+
+	// damped inverse of V, and W * inverse for the Schur complement
+	cv::Matx66d Vinv;
+	cv::Mat Y;
+};
+
+void intrinsicsToMats(const double* a, cv::Mat& camera, cv::Mat& dist)
+{
+	camera = (cv::Mat_<double>(3, 3) << a[0], 0, a[2], 0, a[1], a[3], 0, 0, 1);
+	dist = (cv::Mat_<double>(1, 5) << a[4], a[5], a[6], a[7], a[8]);
+}
+
+// residuals of the projected minus the found corners, x and y interleaved like the rows of the jacobian
+double viewResidual(const cv::Mat& object, const cv::Mat& image, const cv::Vec6d& pose, const cv::Mat& camera, const cv::Mat& dist,
+	cv::Mat& residual, cv::Mat* jacobian)
+{
+	cv::Mat projected;
+	cv::Vec3d rvec(pose[0], pose[1], pose[2]), tvec(pose[3], pose[4], pose[5]);
+	if (jacobian)
+		cv::projectPoints(object, rvec, tvec, camera, dist, projected, *jacobian);
+	else
+		cv::projectPoints(object, rvec, tvec, camera, dist, projected);
+	residual = (projected - image).reshape(1, static_cast<int>(projected.total() * 2));
+	return residual.dot(residual);
+}
+
+// the normal equation blocks of one view at the current parameters
+void buildViewBlock(const cv::Mat& object, const cv::Mat& image, const cv::Vec6d& pose, const cv::Mat& camera, const cv::Mat& dist,
+	const std::vector<int>& freeIntrinsics, ViewBlock& block)
+{
+	cv::Mat residual, jacobian;
+	block.cost = viewResidual(object, image, pose, camera, dist, residual, &jacobian);
+
+	int m = static_cast<int>(freeIntrinsics.size());
+	cv::Mat jb = jacobian.colRange(0, PoseNum);
+	cv::Mat ja(jacobian.rows, m, CV_64F);
+	for (int j = 0; j < m; ++j)
+		jacobian.col(PoseNum + freeIntrinsics[j]).copyTo(ja.col(j));
+
+	cv::Mat v = jb.t() * jb, gb = jb.t() * residual;
+	block.V = cv::Matx66d(v.ptr<double>());
+	block.gb = cv::Vec6d(gb.ptr<double>());
+	block.W = ja.t() * jb;
+	block.U = ja.t() * ja;
+	block.ga = ja.t() * residual;
+}
+
+// damp the diagonal relative to its own scale, zero entries get a tiny floor so the system stays solvable
+void dampDiagonal(double* diag, int n, int step, double lambda)
+{
+	for (int j = 0; j < n; ++j)
+		diag[j * step] += lambda * std::max(diag[j * step], 1e-12);
+}
+
+double calibrateCameraSparse(const std::vector<std::vector<cv::Point3f>>& objectPoints,
+	const std::vector<std::vector<cv::Point2f>>& imagePoints, cv::Size imageSize,
+	cv::Mat& cameraMatrix, cv::Mat& distCoeffs, int flags, cv::TermCriteria criteria,
+	std::vector<cv::Mat>* rvecs, std::vector<cv::Mat>* tvecs)
+{
+	const int supported = cv::CALIB_USE_INTRINSIC_GUESS | cv::CALIB_FIX_PRINCIPAL_POINT | cv::CALIB_ZERO_TANGENT_DIST
+		| cv::CALIB_FIX_K1 | cv::CALIB_FIX_K2 | cv::CALIB_FIX_K3;
+	CV_Assert((flags & ~supported) == 0);
+	CV_Assert(!objectPoints.empty() && objectPoints.size() == imagePoints.size());
+
+	int n = static_cast<int>(objectPoints.size());
+	std::vector<cv::Mat> objects(n), images(n);
+	size_t totalPoints = 0;
+	for (int i = 0; i < n; ++i)
+	{
+		CV_Assert(objectPoints[i].size() == imagePoints[i].size() && objectPoints[i].size() >= 4);
+		// double points, so projectPoints works in double too
+		cv::Mat(objectPoints[i]).convertTo(objects[i], CV_64FC3);
+		cv::Mat(imagePoints[i]).convertTo(images[i], CV_64FC2);
+		totalPoints += objectPoints[i].size();
+	}
+
+	double a[IntrinsicNum] = { 0 };
+	if (flags & cv::CALIB_USE_INTRINSIC_GUESS)
+	{
+		cv::Mat camera, dist;
+		cameraMatrix.convertTo(camera, CV_64F);
+		a[0] = camera.at<double>(0, 0);
+		a[1] = camera.at<double>(1, 1);
+		a[2] = camera.at<double>(0, 2);
+		a[3] = camera.at<double>(1, 2);
+		if (!distCoeffs.empty())
+		{
+			distCoeffs.reshape(1, 1).convertTo(dist, CV_64F);
+			for (int k = 0; k < std::min(5, static_cast<int>(dist.total())); ++k)
+				a[4 + k] = dist.at<double>(k);
+		}
+	}
+	else
+	{
+		// the closed form start of calibrateCamera, the principal point in the image center
+		cv::Mat camera = cv::initCameraMatrix2D(objectPoints, imagePoints, imageSize, 0);
+		a[0] = camera.at<double>(0, 0);
+		a[1] = camera.at<double>(1, 1);
+		a[2] = camera.at<double>(0, 2);
+		a[3] = camera.at<double>(1, 2);
+	}
+	if (flags & cv::CALIB_ZERO_TANGENT_DIST)
+		a[6] = a[7] = 0;
+
+	std::vector<int> freeIntrinsics = { 0, 1 };
+	if (!(flags & cv::CALIB_FIX_PRINCIPAL_POINT))
+		freeIntrinsics.insert(freeIntrinsics.end(), { 2, 3 });
+	if (!(flags & cv::CALIB_FIX_K1))
+		freeIntrinsics.push_back(4);
+	if (!(flags & cv::CALIB_FIX_K2))
+		freeIntrinsics.push_back(5);
+	if (!(flags & cv::CALIB_ZERO_TANGENT_DIST))
+		freeIntrinsics.insert(freeIntrinsics.end(), { 6, 7 });
+	if (!(flags & cv::CALIB_FIX_K3))
+		freeIntrinsics.push_back(8);
+	int m = static_cast<int>(freeIntrinsics.size());
+
+	cv::Mat camera, dist;
+	intrinsicsToMats(a, camera, dist);
+
+	// every pose starts from the board seen through the initial intrinsics
+	std::vector<cv::Vec6d> poses(n);
+	cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& range)
+		{
+			for (int i = range.start; i < range.end; ++i)
+			{
+				cv::Vec3d rvec, tvec;
+				cv::solvePnP(objects[i], images[i], camera, dist, rvec, tvec);
+				poses[i] = cv::Vec6d(rvec[0], rvec[1], rvec[2], tvec[0], tvec[1], tvec[2]);
+			}
+		});
+
+	int maxIter = criteria.type & cv::TermCriteria::COUNT ? criteria.maxCount : 100;
+	double eps = criteria.type & cv::TermCriteria::EPS ? criteria.epsilon : 0;
+	double lambda = 1e-3;
+	std::vector<ViewBlock> blocks(n);
+	std::vector<cv::Vec6d> trialPoses(n);
+	std::vector<double> trialCosts(n);
+
+	auto buildBlocks = [&]()
+	{
+		cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& range)
+			{
+				for (int i = range.start; i < range.end; ++i)
+					buildViewBlock(objects[i], images[i], poses[i], camera, dist, freeIntrinsics, blocks[i]);
+			});
+		double cost = 0;
+		for (auto& block : blocks)
+			cost += block.cost;
+		return cost;
+	};
+
+	double cost = buildBlocks();
+	for (int iter = 0; iter < maxIter; ++iter)
+	{
+		cv::Mat u = cv::Mat::zeros(m, m, CV_64F), ga = cv::Mat::zeros(m, 1, CV_64F);
+		for (auto& block : blocks)
+		{
+			u += block.U;
+			ga += block.ga;
+		}
+
+		bool accepted = false;
+		double trialCost = 0;
+		double trial[IntrinsicNum];
+		while (lambda <= MaxDamping)
+		{
+			// eliminate the poses, S = U - sum W V^-1 W^T, one view per task
+			cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& range)
+				{
+					for (int i = range.start; i < range.end; ++i)
+					{
+						ViewBlock& block = blocks[i];
+						cv::Matx66d v = block.V;
+						dampDiagonal(v.val, PoseNum, PoseNum + 1, lambda);
+						bool ok = false;
+						block.Vinv = v.inv(cv::DECOMP_CHOLESKY, &ok);
+						if (!ok)
+							block.Vinv = v.inv(cv::DECOMP_SVD);
+						block.Y = block.W * cv::Mat(block.Vinv);
+					}
+				});
+
+			cv::Mat s = u.clone(), rhs = -ga;
+			dampDiagonal(s.ptr<double>(), m, m + 1, lambda);
+			for (auto& block : blocks)
+			{
+				s -= block.Y * block.W.t();
+				rhs += block.Y * cv::Mat(block.gb);
+			}
+			cv::Mat da;
+			if (!cv::solve(s, rhs, da, cv::DECOMP_CHOLESKY))
+				cv::solve(s, rhs, da, cv::DECOMP_SVD);
+
+			std::copy(a, a + IntrinsicNum, trial);
+			for (int j = 0; j < m; ++j)
+				trial[freeIntrinsics[j]] += da.at<double>(j);
+			cv::Mat trialCamera, trialDist;
+			intrinsicsToMats(trial, trialCamera, trialDist);
+
+			// back substitute the pose steps and measure the new error, one view per task
+			cv::parallel_for_(cv::Range(0, n), [&](const cv::Range& range)
+				{
+					cv::Mat residual;
+					for (int i = range.start; i < range.end; ++i)
+					{
+						ViewBlock& block = blocks[i];
+						cv::Mat wda = block.W.t() * da;
+						cv::Vec6d db = block.Vinv * (-block.gb - cv::Vec6d(wda.ptr<double>()));
+						trialPoses[i] = poses[i] + db;
+						trialCosts[i] = viewResidual(objects[i], images[i], trialPoses[i], trialCamera, trialDist, residual, nullptr);
+					}
+				});
+			trialCost = 0;
+			for (double c : trialCosts)
+				trialCost += c;
+
+			if (trialCost < cost)
+			{
+				accepted = true;
+				lambda = std::max(lambda / DampingFactor, 1e-12);
+				break;
+			}
+			lambda *= DampingFactor;
+		}
+		if (!accepted)
+			break;
+
+		double change = (cost - trialCost) / std::max(cost, DBL_MIN);
+		std::copy(trial, trial + IntrinsicNum, a);
+		poses.swap(trialPoses);
+		intrinsicsToMats(a, camera, dist);
+		cost = trialCost;
+		if (change < eps)
+			break;
+		cost = buildBlocks();
+	}
+
+	camera.copyTo(cameraMatrix);
+	dist.copyTo(distCoeffs);
+	if (rvecs && tvecs)
+	{
+		rvecs->resize(n);
+		tvecs->resize(n);
+		for (int i = 0; i < n; ++i)
+		{
+			(*rvecs)[i] = (cv::Mat_<double>(3, 1) << poses[i][0], poses[i][1], poses[i][2]);
+			(*tvecs)[i] = (cv::Mat_<double>(3, 1) << poses[i][3], poses[i][4], poses[i][5]);
+		}
+	}
+	return std::sqrt(cost / totalPoints);
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <vector>
+
+
+/*
+ * Drop-in for cv::calibrateCamera with the 5 coefficient distortion model, for calibrations with many views.
+ * Levenberg-Marquardt over the intrinsics and every pose, where the poses are eliminated by the Schur complement,
+ * so each iteration solves a system of the intrinsics only; residuals and jacobians are evaluated per view on all threads.
+ * Supported flags are CALIB_USE_INTRINSIC_GUESS, CALIB_FIX_PRINCIPAL_POINT, CALIB_ZERO_TANGENT_DIST and CALIB_FIX_K1..K3.
+ * @param cameraMatrix, distCoeffs the initial guess with CALIB_USE_INTRINSIC_GUESS, the result as 3x3 and 1x5 double
+ * @param rvecs, tvecs the pose of every view, left alone when null
+ * @return the RMS reprojection error, as calibrateCamera returns it
+ */
+double calibrateCameraSparse(const std::vector<std::vector<cv::Point3f>>& objectPoints,
+	const std::vector<std::vector<cv::Point2f>>& imagePoints, cv::Size imageSize,
+	cv::Mat& cameraMatrix, cv::Mat& distCoeffs, int flags = 0,
+	cv::TermCriteria criteria = cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 100, 1e-12),
+	std::vector<cv::Mat>* rvecs = nullptr, std::vector<cv::Mat>* tvecs = nullptr);
@@ -0,0 +1,126 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cctype>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/highgui.hpp>
+#include <opencv2/videoio.hpp>
+#include "camera_profile.h"
+#include "image_source.h"
+
+using std::cout;
+using std::endl;
+using std::vector;
+
+
+// undistort every jpg of the directory into outDir under the same file name
+int undistortImages(CameraProfile& profile, const std::string& dir, const std::string& outDir)
+{
+	vector<std::string> files = listImages(dir);
+	if (files.empty())
+	{
+		cout << "Cannot find any image in " << dir << endl;
+		return -1;
+	}
+
+	int64 tick = cv::getTickCount();
+	int done = 0;
+	// the next images are decoded while one is undistorted, unreadable ones are reported and skipped by the source
+	ImageSource source(files);
+	cv::Mat image, result;
+	int index;
+	while (source.next(image, index))
+	{
+		profile.undistort(image, result);
+
+		const std::string& file = files[index];
+		std::string name = file.substr(file.find_last_of("/\\") + 1);
+		if (!cv::imwrite(outDir + name, result))
+		{
+			cout << "Cannot write image " << outDir + name << endl;
+			return -1;
+		}
+		done++;
+	}
+	double seconds = static_cast<double>(cv::getTickCount() - tick) / cv::getTickFrequency();
+	cout << "Undistorted " << done << " images in " << seconds << " s\n";
+	return 0;
+}
+
+// undistort every frame of a video file or camera, written to outPath or shown when it is empty
+int undistortStream(CameraProfile& profile, const std::string& source, const std::string& outPath)
+{
+	cv::VideoCapture capture;
+	if (!source.empty() && std::all_of(source.begin(), source.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)) != 0; }))
+		capture.open(std::stoi(source));
+	else
+		capture.open(source);
+	if (!capture.isOpened())
+	{
+		cout << "Cannot open video " << source << endl;
+		return -1;
+	}
+
+	double fps = capture.get(cv::CAP_PROP_FPS);
+	cv::VideoWriter writer;
+	cv::Mat frame, result;
+	int frames = 0;
+	int64 tick = cv::getTickCount();
+	while (capture.read(frame))
+	{
+		profile.undistort(frame, result);
+		frames++;
+
+		if (outPath.empty())
+		{
+			cv::imshow("Undistorted", result);
+			if ((cv::waitKey(1) & 255) == 27)
+				break;
+			continue;
+		}
+		if (!writer.isOpened() && !writer.open(outPath, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), fps > 0 ? fps : 25, result.size()))
+		{
+			cout << "Cannot open output " << outPath << endl;
+			return -1;
+		}
+		writer.write(result);
+	}
+	double seconds = static_cast<double>(cv::getTickCount() - tick) / cv::getTickFrequency();
+	cout << "Undistorted " << frames << " frames, " << (seconds > 0 ? frames / seconds : 0) << " fps\n";
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+
+	if (argc < 3 || argc > 4) {
+		cout << "Error: Unexpected number of input parameters\n";
+		cout << "Usage: " << argv[0] << " [CalibrationResult] [Source] [optional:Output]\n";
+		cout << "CalibrationResult: The path of the result xml file of calibration, the undistortion maps are stored beside it\n";
+		cout << "Source: Directory of images end with \\, a video file, or the index of a camera\n";
+		cout << "Output: Directory end with \\ for images, or a video file. Frames of a video are shown when omitted\n";
+		return -1;
+	}
+
+	std::string resPath(argv[1]);
+	std::string source(argv[2]);
+	std::string output = argc == 4 ? argv[3] : "";
+
+	CameraProfile profile;
+	if (!profile.load(resPath)) {
+		cout << "Error: Couldn't load intrinsic parameters from " << resPath << endl;
+		return -1;
+	}
+
+	bool isDir = !source.empty() && (source.back() == '\\' || source.back() == '/');
+	if (isDir)
+	{
+		if (output.empty())
+		{
+			cout << "Error: Output directory is required for images\n";
+			return -1;
+		}
+		return undistortImages(profile, source, output);
+	}
+	return undistortStream(profile, source, output);
+}